@@ -35,9 +35,31 @@ static inline char *bmname(struct bitmap *bitmap)
 	return bitmap->mddev ? mdname(bitmap->mddev) : "mdX";
 }
 
+/*
+ * The counters are protected by a set of hashed locks rather than one
+ * lock for the whole bitmap, so writes to different chunks don't
+ * contend. The lock is picked by the page index within a node, so the
+ * same page of every node's counters is under one lock and the
+ * *_sync_nodes functions only need a single lock per chunk.
+ */
+static inline spinlock_t *bitmap_page_lock(struct bitmap_counts *bitmap,
+					   unsigned long page)
+{
+	return &bitmap->locks[page % BITMAP_COUNTER_LOCKS];
+}
+
+static inline spinlock_t *bitmap_counter_lock(struct bitmap_counts *bitmap,
+					      sector_t offset)
+{
+	return bitmap_page_lock(bitmap, (offset >> bitmap->chunkshift) >>
+				PAGE_COUNTER_SHIFT);
+}
+
 /*
  * check a page and, if necessary, allocate it (or hijack it if the alloc fails)
  *
+ * 0) other nodes' counters only exist while we track their bitmap, so
+ *    the node's page array itself may need allocating first
  * 1) check to see if this page is allocated, if it's not then try to alloc
  * 2) if the alloc fails, set the page's hijacked flag so we'll use the
  *    page pointer directly as a counter
@@ -45,13 +67,22 @@ static inline char *bmname(struct bitmap *bitmap)
  * if we find our page, we increment the page's refcount so that it stays
  * allocated while we're using it
  */
-static int bitmap_checkpage(struct bitmap_counts *bitmap,
-			    unsigned long page, int create)
-__releases(bitmap->lock)
-__acquires(bitmap->lock)
+static int bitmap_checkpage(struct bitmap_counts *bitmap, int node,
+			    unsigned long page, int create,
+			    struct bitmap_page **bpp)
+__releases(lock)
+__acquires(lock)
 {
 	unsigned char *mappage;
+	struct bitmap_page *bp, *newbp;
+	spinlock_t *lock;
 
+	/* *bpp is the node's array as seen under the lock, NULL if it
+	 * has none.  bitmap_free_node() clears bp[node] without the lock
+	 * but cycles it before freeing, so *bpp stays valid until the
+	 * caller drops the lock.
+	 */
+	*bpp = NULL;
 	if (page >= bitmap->pages) {
 		/* This can happen if bitmap_start_sync goes beyond
 		 * End-of-device while looking for a whole page.
@@ -60,10 +91,30 @@ __acquires(bitmap->lock)
 		return -EINVAL;
 	}
 
-	if (bitmap->bp[page].hijacked) /* it's hijacked, don't try to alloc */
+	lock = bitmap_page_lock(bitmap, page);
+	bp = bitmap->bp[node];
+	if (!bp) {
+		if (!create)
+			return -ENOENT;
+		spin_unlock_irq(lock);
+		newbp = kzalloc(bitmap->pages * sizeof(*newbp), GFP_NOIO);
+		spin_lock_irq(lock);
+		if (!newbp)
+			return -ENOMEM;
+		bp = cmpxchg(&bitmap->bp[node], NULL, newbp);
+		if (bp)
+			kfree(newbp);
+		else {
+			bp = newbp;
+			atomic_long_add(bitmap->pages, &bitmap->missing_pages);
+		}
+	}
+	*bpp = bp;
+
+	if (bp[page].hijacked) /* it's hijacked, don't try to alloc */
 		return 0;
 
-	if (bitmap->bp[page].map) /* page is already allocated, just return */
+	if (bp[page].map) /* page is already allocated, just return */
 		return 0;
 
 	if (!create)
@@ -71,18 +122,26 @@ __acquires(bitmap->lock)
 
 	/* this page has not been allocated yet */
 
-	spin_unlock_irq(&bitmap->lock);
+	spin_unlock_irq(lock);
 	mappage = kzalloc(PAGE_SIZE, GFP_NOIO);
-	spin_lock_irq(&bitmap->lock);
+	spin_lock_irq(lock);
+
+	/* the node may have been released while we slept */
+	bp = bitmap->bp[node];
+	*bpp = bp;
+	if (!bp) {
+		kfree(mappage);
+		return -ENOENT;
+	}
 
 	if (mappage == NULL) {
 		pr_debug("md/bitmap: map page allocation failed, hijacking\n");
 		/* failed - set the hijacked flag so that we can use the
 		 * pointer as a counter */
-		if (!bitmap->bp[page].map)
-			bitmap->bp[page].hijacked = 1;
-	} else if (bitmap->bp[page].map ||
-		   bitmap->bp[page].hijacked) {
+		if (!bp[page].map)
+			bp[page].hijacked = 1;
+	} else if (bp[page].map ||
+		   bp[page].hijacked) {
 		/* somebody beat us to getting the page */
 		kfree(mappage);
 		return 0;
@@ -90,8 +149,8 @@ __acquires(bitmap->lock)
 
 		/* no page was in place and we have one, so install it */
 
-		bitmap->bp[page].map = mappage;
-		bitmap->missing_pages--;
+		bp[page].map = mappage;
+		atomic_long_dec(&bitmap->missing_pages);
 	}
 	return 0;
 }
@@ -99,23 +158,25 @@ __acquires(bitmap->lock)
 /* if page is completely empty, put it back on the free list, or dealloc it */
 /* if page was hijacked, unmark the flag so it might get alloced next time */
 /* Note: lock should be held when calling this */
-static void bitmap_checkfree(struct bitmap_counts *bitmap, unsigned long page)
+static void bitmap_checkfree(struct bitmap_counts *bitmap, int node,
+			     unsigned long page)
 {
+	struct bitmap_page *bp = &bitmap->bp[node][page];
 	char *ptr;
 
-	if (bitmap->bp[page].count) /* page is still busy */
+	if (bp->count) /* page is still busy */
 		return;
 
 	/* page is no longer in use, it can be released */
 
-	if (bitmap->bp[page].hijacked) { /* page was hijacked, undo this now */
-		bitmap->bp[page].hijacked = 0;
-		bitmap->bp[page].map = NULL;
+	if (bp->hijacked) { /* page was hijacked, undo this now */
+		bp->hijacked = 0;
+		bp->map = NULL;
 	} else {
 		/* normal case, free the page */
-		ptr = bitmap->bp[page].map;
-		bitmap->bp[page].map = NULL;
-		bitmap->missing_pages++;
+		ptr = bp->map;
+		bp->map = NULL;
+		atomic_long_inc(&bitmap->missing_pages);
 		kfree(ptr);
 	}
 }
@@ -129,14 +190,17 @@ static void bitmap_checkfree(struct bitmap_counts *bitmap, unsigned long page)
  */
 
 /* IO operations when bitmap is stored near all superblocks */
-static int read_sb_page(struct mddev *mddev, loff_t offset,
-			struct page *page,
-			unsigned long index, int size)
+static int read_sb_pages(struct mddev *mddev, loff_t offset,
+			 struct page **pages,
+			 unsigned long index, int nr, int size)
 {
-	/* choose a good rdev and read the page from there */
+	/* choose a good rdev and read the pages from there.
+	 * size is the number of bytes wanted from the last page.
+	 */
 
 	struct md_rdev *rdev;
 	sector_t target;
+	int i;
 
 	rdev_for_each(rdev, mddev) {
 		if (! test_bit(In_sync, &rdev->flags)
@@ -145,16 +209,24 @@ static int read_sb_page(struct mddev *mddev, loff_t offset,
 
 		target = offset + index * (PAGE_SIZE/512);
 
-		if (sync_page_io(rdev, target,
-				 roundup(size, bdev_logical_block_size(rdev->bdev)),
-				 page, READ, true)) {
-			page->index = index;
+		if (sync_pages_io(rdev, target,
+				  roundup(size, bdev_logical_block_size(rdev->bdev)),
+				  pages, nr, READ, true)) {
+			for (i = 0; i < nr; i++)
+				pages[i]->index = index + i;
 			return 0;
 		}
 	}
 	return -EIO;
 }
 
+static int read_sb_page(struct mddev *mddev, loff_t offset,
+			struct page *page,
+			unsigned long index, int size)
+{
+	return read_sb_pages(mddev, offset, &page, index, 1, size);
+}
+
 static struct md_rdev *next_active_rdev(struct md_rdev *rdev, struct mddev *mddev)
 {
 	/* Iterate the disks of an mddev, using rcu to protect access to the
@@ -186,33 +258,44 @@ static struct md_rdev *next_active_rdev(struct md_rdev *rdev, struct mddev *mdde
 	return NULL;
 }
 
-static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
+/* write nr filemap pages with consecutive indexes, starting at pages[0].
+ * If tail is set only that many bytes of the last page are written.
+ */
+static int write_sb_pages(struct bitmap *bitmap, struct page **pages, int nr,
+			  int tail, int wait)
 {
 	struct md_rdev *rdev = NULL;
 	struct block_device *bdev;
 	struct mddev *mddev = bitmap->mddev;
 	struct bitmap_storage *store = &bitmap->storage;
+	/* the checks below are about the whole run */
+	struct page *page = pages[0];
+	unsigned long last = page->index + nr - 1;
 
 
 	while ((rdev = next_active_rdev(rdev, mddev)) != NULL) {
 		int size = PAGE_SIZE;
+		int len;
 		loff_t offset = mddev->bitmap_info.offset;
 
 		bdev = (rdev->meta_bdev) ? rdev->meta_bdev : rdev->bdev;
 
-		if (page->index == store->file_pages-1) {
+		if (tail)
+			size = roundup(tail, bdev_logical_block_size(bdev));
+		else if (last == store->file_pages-1) {
 			int last_page_size = store->bytes & (PAGE_SIZE-1);
 			if (last_page_size == 0)
 				last_page_size = PAGE_SIZE;
 			size = roundup(last_page_size,
 				       bdev_logical_block_size(bdev));
 		}
+		len = (nr - 1) * PAGE_SIZE + size;
 		/* Just make sure we aren't corrupting data or
 		 * metadata
 		 */
 		if (mddev->external) {
 			/* Bitmap could be anywhere. */
-			if (rdev->sb_start + offset + (page->index
+			if (rdev->sb_start + offset + (last
 						       * (PAGE_SIZE/512))
 			    > rdev->data_offset
 			    &&
@@ -224,7 +307,7 @@ static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
 			/* DATA  BITMAP METADATA  */
 			if (offset
 			    + (long)(page->index * (PAGE_SIZE/512))
-			    + size/512 > 0)
+			    + len/512 > 0)
 				/* bitmap runs in to metadata */
 				goto bad_alignment;
 			if (rdev->data_offset + mddev->dev_sectors
@@ -235,18 +318,17 @@ static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
 			/* METADATA BITMAP DATA */
 			if (rdev->sb_start
 			    + offset
-			    + page->index*(PAGE_SIZE/512) + size/512
+			    + page->index*(PAGE_SIZE/512) + len/512
 			    > rdev->data_offset)
 				/* bitmap runs in to data */
 				goto bad_alignment;
 		} else {
 			/* DATA METADATA BITMAP - no problems */
 		}
-		md_super_write(mddev, rdev,
-			       rdev->sb_start + offset
-			       + page->index * (PAGE_SIZE/512),
-			       size,
-			       page);
+		md_super_write_pages(mddev, rdev,
+				     rdev->sb_start + offset
+				     + page->index * (PAGE_SIZE/512),
+				     size, pages, nr);
 	}
 
 	if (wait)
@@ -257,6 +339,11 @@ static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
 	return -EINVAL;
 }
 
+static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
+{
+	return write_sb_pages(bitmap, &page, 1, 0, wait);
+}
+
 static void bitmap_file_kick(struct bitmap *bitmap);
 /*
  * write out a page to a file
@@ -290,6 +377,47 @@ static void write_page(struct bitmap *bitmap, struct page *page, int wait)
 		bitmap_file_kick(bitmap);
 }
 
+/*
+ * A run of dirty filemap pages, gathered by the flush paths so that
+ * consecutive pages go out together rather than one write each.
+ */
+struct page_run {
+	unsigned long first;
+	int nr;
+};
+
+static void flush_page_run(struct bitmap *bitmap, struct page_run *run)
+{
+	struct page **pages = &bitmap->storage.filemap[run->first];
+	int i;
+
+	if (!run->nr)
+		return;
+	if (bitmap->storage.file == NULL) {
+		switch (write_sb_pages(bitmap, pages, run->nr, 0, 0)) {
+		case -EINVAL:
+			set_bit(BITMAP_WRITE_ERROR, &bitmap->flags);
+		}
+		if (test_bit(BITMAP_WRITE_ERROR, &bitmap->flags))
+			bitmap_file_kick(bitmap);
+	} else {
+		for (i = 0; i < run->nr; i++)
+			write_page(bitmap, pages[i], 0);
+	}
+	run->nr = 0;
+}
+
+static void add_page_run(struct bitmap *bitmap, struct page_run *run,
+			 unsigned long pnum)
+{
+	if (run->nr &&
+	    (run->first + run->nr != pnum || run->nr == BIO_MAX_PAGES))
+		flush_page_run(bitmap, run);
+	if (!run->nr)
+		run->first = pnum;
+	run->nr++;
+}
+
 static void end_bitmap_write(struct buffer_head *bh, int uptodate)
 {
 	struct bitmap *bitmap = bh->b_private;
@@ -397,16 +525,65 @@ out:
  * bitmap file superblock operations
  */
 
+static void bitmap_queue_sb(struct bitmap *bitmap);
+static void bitmap_write_sb(struct bitmap *bitmap);
+
+/* the first page of a node's region holds only its event counter */
+static inline unsigned long counter_page_index(struct bitmap_storage *store,
+					       int node)
+{
+	return store->per_node_pages * node + (store->sb_page ? 1 : 0);
+}
+
+/*
+ * write out a node's event counter. Only the sector (or logical block)
+ * holding it goes to disk, and as it has its page to itself no bitmap
+ * page write ever carries an older copy of it.
+ */
+static void write_counter(struct bitmap *bitmap, int node, int wait)
+{
+	struct page *page;
+
+	page = bitmap->storage.filemap[counter_page_index(&bitmap->storage,
+							  node)];
+	if (bitmap->storage.file) {
+		write_page(bitmap, page, wait);
+		return;
+	}
+	switch (write_sb_pages(bitmap, &page, 1, sizeof(event_counter_t), wait)) {
+	case -EINVAL:
+		set_bit(BITMAP_WRITE_ERROR, &bitmap->flags);
+	}
+	if (test_bit(BITMAP_WRITE_ERROR, &bitmap->flags))
+		bitmap_file_kick(bitmap);
+}
+
+/* bring a node's event counter up to date and start writing it */
+static void bitmap_update_counter(struct bitmap *bitmap, int node)
+{
+	struct mddev *mddev = bitmap->mddev;
+	struct events_info *info = &bitmap->events[node];
+	event_counter_t *counter;
+	struct page *page;
+
+	page = bitmap->storage.filemap[counter_page_index(&bitmap->storage,
+							  node)];
+	counter = kmap_atomic(page);
+	counter->events = cpu_to_le64(mddev->events);
+	if (mddev->events < info->events_cleared) {
+		info->events_cleared = mddev->events;
+	}
+	counter->events_cleared = cpu_to_le64(info->events_cleared);
+	counter->state = cpu_to_le32(info->flags);
+	kunmap_atomic(counter);
+	write_counter(bitmap, node, 0);
+}
+
 /* update the event counter and sync the superblock to disk */
 void bitmap_update_sb(struct bitmap *bitmap)
 {
 	bitmap_super_t *sb;
-	int ret = -EAGAIN;
 	struct mddev *mddev;
-	event_counter_t *counter;
-	struct events_info *info;
-	struct page *page;
-	unsigned long per_section;
 	int i;
 
 	mddev = bitmap->mddev;
@@ -434,47 +611,23 @@ void bitmap_update_sb(struct bitmap *bitmap)
 	sb->sectors_reserved = cpu_to_le32(bitmap->mddev->
 					   bitmap_info.space);
 	kunmap_atomic(sb);
+	bitmap_queue_sb(bitmap);
 
-	ret = md_lock_super(bitmap->mddev, DLM_LOCK_EX);
-	if (ret) {
-		return;
-	}
-	write_page(bitmap, bitmap->storage.sb_page, 1);
-	md_unlock_super(bitmap->mddev);
-	if (bitmap->used != -1) {
-		info = &bitmap->events[bitmap->used];
-		per_section = bitmap->storage.per_node_pages * bitmap->used + 1;
-		page = bitmap->storage.filemap[per_section];
-		counter = kmap_atomic(page);
-		counter->events = cpu_to_le64(mddev->events);
-		if (mddev->events < info->events_cleared) {
-			info->events_cleared = mddev->events;
-		}
-		counter->events_cleared = cpu_to_le64(info->events_cleared);
-		counter->state = cpu_to_le32(info->flags);
-		kunmap_atomic(counter);
-		write_page(bitmap, page, 1);
-	}
+	/* the per-node counters carry the events that matter on load,
+	 * and each node's lives in its own region, so they are written
+	 * straight away without the cluster super lock.
+	 */
+	if (bitmap->used != -1)
+		bitmap_update_counter(bitmap, bitmap->used);
 	if (mddev->avail_bitmap) {
-		for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-			if (mddev->avail_bitmap[i] == -1) {
-				continue;
-			}
-			info = &bitmap->events[mddev->avail_bitmap[i]];
-			per_section = bitmap->storage.per_node_pages * mddev->avail_bitmap[i] 
-					+ 1;
-			page = bitmap->storage.filemap[per_section];
-			counter = kmap_atomic(page);
-			counter->events = cpu_to_le64(mddev->events);
-			if (mddev->events < info->events_cleared) {
-				info->events_cleared = mddev->events;
-			}
-			counter->events_cleared = cpu_to_le64(info->events_cleared);
-			counter->state = cpu_to_le32(info->flags);
-			kunmap_atomic(counter);
-			write_page(bitmap, page, 1);
-		}
+		for_each_set_bit(i, mddev->avail_bitmap, mddev->bitmap_info.nodes)
+			bitmap_update_counter(bitmap, i);
 	}
+	if (bitmap->storage.file)
+		wait_event(bitmap->write_wait,
+			   atomic_read(&bitmap->pending_writes)==0);
+	else
+		md_super_wait(mddev);
 }
 
 /* print out the bitmap file superblock */
@@ -746,8 +899,7 @@ static inline struct page *filemap_get_page(struct bitmap_storage *store,
 {
 	if (file_page_index(store, node, chunk) >= store->file_pages)
 		return NULL;
-	return store->filemap[file_page_index(store, node, chunk)
-			      - file_page_index(store, node, 0)];
+	return store->filemap[file_page_index(store, node, chunk)];
 }
 
 static int bitmap_storage_alloc(struct bitmap_storage *store,
@@ -796,6 +948,10 @@ static int bitmap_storage_alloc(struct bitmap_storage *store,
 		GFP_KERNEL);
 	if (!store->filemap_attr)
 		return -ENOMEM;
+	store->attr_pages = kzalloc(BITS_TO_LONGS(num_pages) *
+				    sizeof(unsigned long), GFP_KERNEL);
+	if (!store->attr_pages)
+		return -ENOMEM;
 
 	store->bytes = bytes;
 
@@ -818,6 +974,7 @@ static void bitmap_file_unmap(struct bitmap_storage *store)
 			free_buffers(map[pages]);
 	kfree(map);
 	kfree(store->filemap_attr);
+	kfree(store->attr_pages);
 
 	if (sb_page)
 		free_buffers(sb_page);
@@ -870,6 +1027,8 @@ static inline void set_page_attr(struct bitmap *bitmap, int pnum,
 				 enum bitmap_page_attr attr)
 {
 	set_bit((pnum<<2) + attr, bitmap->storage.filemap_attr);
+	/* after the attribute, see next_attr_page() */
+	set_bit(pnum, bitmap->storage.attr_pages);
 }
 
 static inline void clear_page_attr(struct bitmap *bitmap, int pnum,
@@ -890,6 +1049,39 @@ static inline int test_and_clear_page_attr(struct bitmap *bitmap, int pnum,
 	return test_and_clear_bit((pnum<<2) + attr,
 				  bitmap->storage.filemap_attr);
 }
+
+static inline int page_has_attr(struct bitmap *bitmap, int pnum)
+{
+	return test_page_attr(bitmap, pnum, BITMAP_PAGE_DIRTY) ||
+		test_page_attr(bitmap, pnum, BITMAP_PAGE_PENDING) ||
+		test_page_attr(bitmap, pnum, BITMAP_PAGE_NEEDWRITE);
+}
+
+/*
+ * Find the next filemap page in [pnum, end) with an attribute set, so
+ * the flush paths only visit pages that may need work. Pages with
+ * nothing left are dropped from attr_pages on the way; a racing
+ * set_page_attr sets the bit again after its attribute, which the
+ * recheck catches.
+ */
+static unsigned long next_attr_page(struct bitmap *bitmap,
+				    unsigned long pnum, unsigned long end)
+{
+	unsigned long *pages = bitmap->storage.attr_pages;
+
+	while ((pnum = find_next_bit(pages, end, pnum)) < end) {
+		if (page_has_attr(bitmap, pnum))
+			return pnum;
+		clear_bit(pnum, pages);
+		smp_mb__after_clear_bit();
+		if (page_has_attr(bitmap, pnum)) {
+			set_bit(pnum, pages);
+			return pnum;
+		}
+		pnum++;
+	}
+	return end;
+}
 /*
  * bitmap_file_set_bit -- called before performing a write to the md device
  * to set (and eventually sync) a particular bit in the bitmap file
@@ -944,25 +1136,76 @@ static void bitmap_file_clear_bit(struct bitmap *bitmap, int node, sector_t bloc
 	}
 }
 
+/*
+ * The shared bitmap superblock is only written by the daemon, under the
+ * cluster super lock. Changes to it just mark page 0 and coalesce until
+ * the next daemon run.
+ */
+static void bitmap_queue_sb(struct bitmap *bitmap)
+{
+	if (!bitmap->storage.filemap) {
+		/* not set up yet, write it now */
+		bitmap_write_sb(bitmap);
+		return;
+	}
+	set_page_attr(bitmap, 0, BITMAP_PAGE_NEEDWRITE);
+	bitmap->allclean = 0;
+	if (bitmap->mddev->thread &&
+	    bitmap->mddev->thread->timeout == MAX_SCHEDULE_TIMEOUT)
+		bitmap->mddev->thread->timeout =
+			bitmap->mddev->bitmap_info.daemon_sleep;
+}
+
+/* write out the shared superblock page if it has changed */
+static void bitmap_write_sb(struct bitmap *bitmap)
+{
+	struct mddev *mddev = bitmap->mddev;
+	int dirty, need_write;
+
+	if (!bitmap->storage.sb_page)
+		return;
+	if (bitmap->storage.filemap) {
+		dirty = test_and_clear_page_attr(bitmap, 0, BITMAP_PAGE_DIRTY);
+		need_write = test_and_clear_page_attr(bitmap, 0,
+						      BITMAP_PAGE_NEEDWRITE);
+		if (!dirty && !need_write)
+			return;
+		clear_page_attr(bitmap, 0, BITMAP_PAGE_PENDING);
+	}
+	if (md_lock_super(mddev, DLM_LOCK_EX)) {
+		printk(KERN_WARNING "lock super failed!\n");
+		/* try again on the next daemon run */
+		if (bitmap->storage.filemap)
+			set_page_attr(bitmap, 0, BITMAP_PAGE_NEEDWRITE);
+		return;
+	}
+	write_page(bitmap, bitmap->storage.sb_page, 1);
+	md_unlock_super(mddev);
+}
+
 /* this gets called when the md device is ready to unplug its underlying
  * (slave) device queues -- before we let any writes go down, we need to
  * sync the dirty pages of the bitmap file to disk */
 void bitmap_unplug(struct bitmap *bitmap)
 {
-	unsigned long i;
+	unsigned long i, start, end;
 	int dirty, need_write;
 	int wait = 0;
-	int ret = -EAGAIN;
+	struct page_run run = { 0, 0 };
 
 	if (!bitmap || !bitmap->storage.filemap ||
-	    test_bit(BITMAP_STALE, &bitmap->flags))
+	    test_bit(BITMAP_STALE, &bitmap->flags) || bitmap->used == -1)
 		return;
 
 	/* look at each page to see if there are any set bits that need to be
-	 * flushed out to disk */
-	i = bitmap->used * bitmap->storage.per_node_pages + 1;
-	for (i = 0; i < ((bitmap->used + 1) * bitmap->storage.per_node_pages + 1); ) {
-		/* need to lock to write sb page? */
+	 * flushed out to disk. Only our own region is written here, we own
+	 * it through the bitmap EX lock, so no cluster lock is needed.
+	 */
+	start = counter_page_index(&bitmap->storage, bitmap->used);
+	end = min(start + bitmap->storage.per_node_pages,
+		  bitmap->storage.file_pages);
+	for (i = next_attr_page(bitmap, start, end); i < end;
+	     i = next_attr_page(bitmap, i + 1, end)) {
 		if (!bitmap->storage.filemap)
 			return;
 		dirty = test_and_clear_page_attr(bitmap, i, BITMAP_PAGE_DIRTY);
@@ -970,27 +1213,12 @@ void bitmap_unplug(struct bitmap *bitmap)
 						      BITMAP_PAGE_NEEDWRITE);
 		if (dirty || need_write) {
 			clear_page_attr(bitmap, i, BITMAP_PAGE_PENDING);
-			if (!i) {
-				ret = md_lock_super(bitmap->mddev, DLM_LOCK_EX);
-				if (ret) {
-					printk(KERN_WARNING "lock super failed!\n");
-					break;
-				}
-			}
-			write_page(bitmap, bitmap->storage.filemap[i], 0);
-			if (!i) {
-				md_super_wait(bitmap->mddev);
-				md_unlock_super(bitmap->mddev);
-			}
+			add_page_run(bitmap, &run, i);
 		}
 		if (dirty)
 			wait = 1;
-		if (!i) {
-			i = bitmap->used * bitmap->storage.per_node_pages + 1;
-		} else {
-			i++;
-		}
 	}
+	flush_page_run(bitmap, &run);
 	if (wait) { /* if any writes were performed, we need to wait on them */
 		if (bitmap->storage.file)
 			wait_event(bitmap->write_wait,
@@ -1005,6 +1233,134 @@ void bitmap_unplug(struct bitmap *bitmap)
 EXPORT_SYMBOL(bitmap_unplug);
 
 static void bitmap_set_memory_bits(struct bitmap *bitmap,int node, sector_t offset, int needed);
+static void bitmap_set_memory_range(struct bitmap *bitmap, int node,
+				    unsigned long chunk, unsigned long n,
+				    sector_t start);
+
+/*
+ * read one node's region of the on-disk bitmap and set the memory bits
+ * for every bit found set, counting them in *bit_cnt.
+ */
+static int bitmap_read_node(struct bitmap *bitmap, int node, sector_t start,
+			    unsigned long *bit_cnt)
+{
+	unsigned long i, index, cpage, first, last, base;
+	unsigned long b, e, size;
+	unsigned long chunks = bitmap->counts.chunks;
+	struct bitmap_storage *store = &bitmap->storage;
+	struct mddev *mddev = bitmap->mddev;
+	struct file *file = store->file;
+	struct page *page;
+	int count;
+	int outofdate;
+	int ret;
+	void *paddr;
+	struct events_info *info;
+	struct event_counter_s *counter;
+	__u64 events;
+
+	/* this node's counter and bits, read in one go */
+	cpage = counter_page_index(store, node);
+	first = file_page_index(store, node, 0);
+	last = file_page_index(store, node, chunks - 1);
+	base = file_page_offset(store, node, 0);
+	if (last == store->file_pages-1)
+		count = store->bytes - last * PAGE_SIZE;
+	else
+		count = PAGE_SIZE;
+	if (file) {
+		for (index = cpage; index <= last; index++) {
+			ret = read_page(file, index, bitmap,
+					index == last ? count : PAGE_SIZE,
+					store->filemap[index]);
+			if (ret)
+				return ret;
+		}
+	} else {
+		ret = read_sb_pages(mddev, mddev->bitmap_info.offset,
+				    store->filemap + cpage, cpage,
+				    last - cpage + 1, count);
+		if (ret)
+			return ret;
+	}
+
+	counter = kmap_atomic(store->filemap[cpage]);
+	info = &bitmap->events[node];
+	info->events_cleared =
+		le64_to_cpu(counter->events_cleared);
+	events = le64_to_cpu(counter->events);
+	if (mddev->persistent) {
+		if (events < mddev->events) {
+			printk(KERN_INFO
+			       "%s: bitmap file is out of date (%llu < %llu) "
+			       "-- forcing full recovery\n",
+			       bmname(bitmap), events,
+			       (unsigned long long) bitmap->mddev->events);
+			set_bit(BITMAP_STALE, &info->flags);
+		}
+	}
+	info->flags |= le32_to_cpu(counter->state);
+	outofdate = test_bit(BITMAP_STALE, &info->flags);
+	if (outofdate) {
+		printk(KERN_INFO "%s: bitmap file for node "
+		       "%d is out of date, doing full "
+		       "recovery\n", bmname(bitmap), node);
+		info->events_cleared = mddev->events;
+	}
+	kunmap_atomic(counter);
+
+	if (outofdate) {
+		/*
+		 * if bitmap is out of date, dirty the
+		 * whole region and write it out
+		 */
+		for (index = first; index <= last; index++) {
+			page = store->filemap[index];
+			paddr = kmap_atomic(page);
+			memset(paddr, 0xff, PAGE_SIZE);
+			kunmap_atomic(paddr);
+			write_page(bitmap, page, 1);
+
+			ret = -EIO;
+			if (test_bit(BITMAP_WRITE_ERROR,
+				     &bitmap->flags))
+				return ret;
+		}
+	}
+
+	/* Find each run of set bits a word at a time and set
+	 * the memory bits for all of it together.
+	 */
+	for (index = first; index <= last; index++) {
+		page = store->filemap[index];
+		b = index == first ? base : 0;
+		if (index == last)
+			size = file_page_offset(store, node, chunks - 1) + 1;
+		else
+			size = PAGE_BITS;
+		paddr = kmap(page);
+		for (;;) {
+			if (test_bit(BITMAP_HOSTENDIAN, &bitmap->flags)) {
+				b = find_next_bit(paddr, size, b);
+				e = find_next_zero_bit(paddr, size, b);
+			} else {
+				b = find_next_bit_le(paddr, size, b);
+				e = find_next_zero_bit_le(paddr, size, b);
+			}
+			if (b >= size)
+				break;
+			/* chunk number of bit b */
+			i = (index - first) * PAGE_BITS + b - base;
+			bitmap_set_memory_range(bitmap, node, i, e - b, start);
+			*bit_cnt += e - b;
+			b = e;
+		}
+		kunmap(page);
+	}
+
+	return 0;
+}
+
 /* * bitmap_init_from_disk -- called at bitmap_create time to initialize
  * the in-memory bitmap from the on-disk bitmap -- also, sets up the
  * memory mapping of the bitmap file
@@ -1018,19 +1374,13 @@ static void bitmap_set_memory_bits(struct bitmap *bitmap,int node, sector_t offs
  */
 static int bitmap_init_from_disk(struct bitmap *bitmap, sector_t start)
 {
-	unsigned long i, chunks, index, oldindex, bit, j;
-	struct page *page = NULL;
+	unsigned long chunks, j;
 	unsigned long bit_cnt = 0;
 	struct file *file;
-	unsigned long offset;
 	int outofdate;
 	int ret = -ENOSPC;
-	void *paddr;
 	struct bitmap_storage *store = &bitmap->storage;
 	struct mddev *mddev = bitmap->mddev;
-	struct events_info *info;
-	struct event_counter_s *counter;
-	__u64 events;
 
 	chunks = bitmap->counts.chunks;
 	file = store->file;
@@ -1068,105 +1418,16 @@ static int bitmap_init_from_disk(struct bitmap *bitmap, sector_t start)
 		goto err;
 	}
 
-	oldindex = ~0L;
-	offset = 0;
-	if (!bitmap->mddev->bitmap_info.external)
-		offset = sizeof(bitmap_super_t);
+	if (!chunks)
+		goto done;
 
 	for (j = 0; j < mddev->bitmap_info.nodes; j++) {
-		offset = PER_NODE_COUNTER;
-		outofdate = 0;
-		for (i = 0; i < chunks; i++) {
-			int b;
-			index = file_page_index(&bitmap->storage, j, i);
-			bit = file_page_offset(&bitmap->storage, j, i);
-			if (index != oldindex) { /* this is a new page, read it in */
-				int count;
-				/* unmap the old page, we're done with it */
-				if (index == store->file_pages-1)
-					count = store->bytes - index * PAGE_SIZE;
-				else
-					count = PAGE_SIZE;
-				page = store->filemap[index];
-				if (file)
-					ret = read_page(file, index, bitmap,
-							count, page);
-				else
-					ret = read_sb_page(
-						bitmap->mddev,
-						bitmap->mddev->bitmap_info.offset,
-						page,
-						index, count);
-
-				if (ret)
-					goto err;
-
-				oldindex = index;
-
-				if (offset) {
-					/* this is the page contains events info. */
-					counter = kmap_atomic(page);
-					info = &bitmap->events[j];
-					info->events_cleared = 
-						le64_to_cpu(counter->events_cleared);
-					events = le64_to_cpu(counter->events);
-					if (mddev->persistent) {
-						if (events < mddev->events) {
-							printk(KERN_INFO
-			       				"%s: bitmap file is out of date (%llu < %llu) "
-			       				"-- forcing full recovery\n",
-			       				bmname(bitmap), events,
-			       				(unsigned long long) bitmap->mddev->events);
-							set_bit(BITMAP_STALE, &info->flags);
-						}
-					}
-					info->flags |= le32_to_cpu(counter->state);
-					outofdate = test_bit(BITMAP_STALE, &info->flags);
-					if (outofdate) {
-						printk(KERN_INFO "%s: bitmap file for node "
-						"%ld is out of date, doing full "
-						"recovery\n", bmname(bitmap), j);
-						info->events_cleared = mddev->events;
-					}
-					kunmap_atomic(counter);
-				}
-
-				if (outofdate) {
-					/*
-					 * if bitmap is out of date, dirty the
-					 * whole page and write it out
-					 */
-					paddr = kmap_atomic(page);
-					memset(paddr + offset, 0xff,
-					       PAGE_SIZE - offset);
-					kunmap_atomic(paddr);
-					write_page(bitmap, page, 1);
-
-					ret = -EIO;
-					if (test_bit(BITMAP_WRITE_ERROR,
-						     &bitmap->flags))
-						goto err;
-				}
-			}
-			paddr = kmap_atomic(page);
-			if (test_bit(BITMAP_HOSTENDIAN, &bitmap->flags))
-				b = test_bit(bit, paddr);
-			else
-				b = test_bit_le(bit, paddr);
-			kunmap_atomic(paddr);
-			if (b) {
-				/* if the disk bit is set, set the memory bit */
-				int needed = ((sector_t)(i+1) << bitmap->counts.chunkshift
-					      >= start);
-				bitmap_set_memory_bits(bitmap, j,
-						       (sector_t)i << bitmap->counts.chunkshift,
-						       needed);
-				bit_cnt++;
-			}
-			offset = 0;
-		}
+		ret = bitmap_read_node(bitmap, j, start, &bit_cnt);
+		if (ret)
+			goto err;
 	}
 
+done:
 	printk(KERN_INFO "%s: bitmap initialized from disk: "
 	       "read %lu pages, set %lu of %lu bits\n",
 	       bmname(bitmap), store->file_pages,
@@ -1180,6 +1441,44 @@ static int bitmap_init_from_disk(struct bitmap *bitmap, sector_t start)
 	return ret;
 }
 
+/*
+ * A node's bitmap lock was granted to us after waiting for it, so the
+ * node that held it has gone. Its bits are read in here, away from
+ * raid1d, and only then is the bitmap offered to recovery.
+ */
+static void bitmap_load_node_work(struct work_struct *ws)
+{
+	struct bitmap_node_load *load =
+		container_of(to_delayed_work(ws), struct bitmap_node_load, work);
+	struct bitmap *bitmap = load->bitmap;
+	struct mddev *mddev = bitmap->mddev;
+	unsigned long bit_cnt = 0;
+	int ret = 0;
+
+	mutex_lock(&mddev->bitmap_info.mutex);
+	if (bitmap->storage.filemap && bitmap->counts.chunks)
+		/* all of it needs resyncing, whatever recovery_cp says */
+		ret = bitmap_read_node(bitmap, load->node, 0, &bit_cnt);
+	mutex_unlock(&mddev->bitmap_info.mutex);
+
+	if (ret) {
+		/* still LOADING with CR held: nobody else will offer its
+		 * dirty regions to recovery, so keep trying */
+		printk(KERN_WARNING "%s: reading bitmap of node %d failed: %d, retrying\n",
+		       bmname(bitmap), load->node, ret);
+		schedule_delayed_work(&load->work,
+				      mddev->bitmap_info.daemon_sleep);
+		return;
+	}
+	printk(KERN_INFO "%s: bitmap of node %d loaded, %lu bits set\n",
+	       bmname(bitmap), load->node, bit_cnt);
+	mddev->dlm_md_bitmap[load->node]->state = BITMAP_LOCK_AVAIL;
+	set_bit(load->node, mddev->avail_bitmap);
+	set_bit(MD_RECOVERY_NEEDED, &mddev->recovery);
+	md_wakeup_thread(mddev->thread);
+	bitmap_kick_locks(mddev);
+}
+
 void bitmap_write_all(struct bitmap *bitmap)
 {
 	/* We don't actually write all bitmap blocks here,
@@ -1205,20 +1504,51 @@ static void bitmap_count_page(struct bitmap_counts *bitmap,
 	sector_t chunk = offset >> bitmap->chunkshift;
 	unsigned long page = chunk >> PAGE_COUNTER_SHIFT;
 
-	page += (bitmap->pages * node);
-	bitmap->bp[page].count += inc;
-	bitmap_checkfree(bitmap, page);
+	struct bitmap_page *bp = &bitmap->bp[node][page];
+
+	bp->count += inc;
+	if (bp->count)
+		set_bit(bitmap->pages * node + page, bitmap->dirty_pages);
+	else
+		clear_bit(bitmap->pages * node + page, bitmap->dirty_pages);
+	bitmap_checkfree(bitmap, node, page);
+}
+
+/*
+ * Return where the next counter page that is dirty in any of the
+ * bitmaps in nodes starts, or offset itself if its own page is dirty.
+ * A page with a zero count holds no NEEDED or RESYNC counters, so
+ * resync can step over a run of them in one go.
+ * Called with the counter lock for offset held; other pages may change
+ * under us, which is no different from them changing just after.
+ */
+static sector_t bitmap_next_dirty(struct bitmap_counts *bitmap,
+				  unsigned long *nodes, sector_t offset)
+{
+	unsigned long page = (offset >> bitmap->chunkshift) >> PAGE_COUNTER_SHIFT;
+	unsigned long next = bitmap->pages;
+	unsigned long base, n;
+	int node;
+
+	if (page >= bitmap->pages)
+		return offset;
+	for_each_set_bit(node, nodes, bitmap->nodes) {
+		base = bitmap->pages * node;
+		n = find_next_bit(bitmap->dirty_pages, base + bitmap->pages,
+				  base + page) - base;
+		if (n == page)
+			return offset;
+		if (n < next)
+			next = n;
+	}
+	return (sector_t)next << (bitmap->chunkshift + PAGE_COUNTER_SHIFT);
 }
 
 static void bitmap_set_pending(struct bitmap_counts *bitmap, int node, sector_t offset)
 {
 	sector_t chunk = offset >> bitmap->chunkshift;
 	unsigned long page = chunk >> PAGE_COUNTER_SHIFT;
-	struct bitmap_page *bp = &bitmap->bp[page];
-
-
-	page += bitmap->pages * node;
-	bp = &bitmap->bp[page];
+	struct bitmap_page *bp = &bitmap->bp[node][page];
 
 	if (!bp->pending)
 		bp->pending = 1;
@@ -1241,12 +1571,13 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 	sector_t blocks;
 	struct bitmap_counts *counts;
 	struct events_info *info;
+	struct page_run run = { 0, 0 };
+	struct bitmap_page *bp;
+	spinlock_t *lock;
 
 	/* Use a mutex to guard daemon_work against
 	 * bitmap_destroy.
 	 */
-	bitmap = mddev->bitmap;
-	info = &bitmap->events[node];
 	mutex_lock(&mddev->bitmap_info.mutex);
 	bitmap = mddev->bitmap;
 	if (bitmap == NULL) {
@@ -1258,6 +1589,11 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 		goto done;
 
 	bitmap->daemon_lastrun = jiffies;
+	/* superblock changes since the last run go out in one write */
+	bitmap_write_sb(bitmap);
+	if (node < 0)
+		goto done;
+	info = &bitmap->events[node];
 	if (bitmap->allclean) {
 		mddev->thread->timeout = MAX_SCHEDULE_TIMEOUT;
 		goto done;
@@ -1268,19 +1604,15 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 	 * So set NEEDWRITE now, then after we make any last-minute changes
 	 * we will write it.
 	 */
-	start = bitmap->storage.per_node_pages * node + 1;
-	end = bitmap->storage.per_node_pages * (node + 1) + 1;
-	for (j = 0; j < end; ) {
+	start = counter_page_index(&bitmap->storage, node);
+	end = min(start + bitmap->storage.per_node_pages,
+		  bitmap->storage.file_pages);
+	for (j = next_attr_page(bitmap, start, end); j < end;
+	     j = next_attr_page(bitmap, j + 1, end))
 		if (test_and_clear_page_attr(bitmap, j,
 					     BITMAP_PAGE_PENDING))
 			set_page_attr(bitmap, j,
 				      BITMAP_PAGE_NEEDWRITE);
-		if (!j) {
-			j = start;
-		} else {
-			j++;
-		}
-	}
 
 	if (info->need_sync &&
 	    mddev->bitmap_info.external == 0) {
@@ -1295,7 +1627,7 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 			counter = kmap_atomic(bitmap->storage.filemap[start]);
 			counter->events_cleared = cpu_to_le64(info->events_cleared);
 			kunmap_atomic(counter);
-			set_page_attr(bitmap, start, BITMAP_PAGE_NEEDWRITE);
+			write_counter(bitmap, node, 0);
 		}
 		/*
 		if (bitmap->storage.filemap) {
@@ -1312,7 +1644,7 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 	 * decrement and handle accordingly.
 	 */
 	counts = &bitmap->counts;
-	spin_lock_irq(&counts->lock);
+	lock = NULL;
 	nextpage = 0;
 	for (j = 0; j < counts->chunks; j++) {
 		bitmap_counter_t *bmc;
@@ -1320,11 +1652,17 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 
 		if (j == nextpage) {
 			nextpage += PAGE_COUNTER_RATIO;
-			if (!counts->bp[(j >> PAGE_COUNTER_SHIFT) + counts->pages * node].pending) {
+			/* one counter page at a time */
+			if (lock)
+				spin_unlock_irq(lock);
+			lock = bitmap_page_lock(counts, j >> PAGE_COUNTER_SHIFT);
+			spin_lock_irq(lock);
+			bp = counts->bp[node];
+			if (!bp || !bp[j >> PAGE_COUNTER_SHIFT].pending) {
 				j |= PAGE_COUNTER_MASK;
 				continue;
 			}
-			counts->bp[(j >> PAGE_COUNTER_SHIFT) + counts->pages * node].pending = 0;
+			bp[j >> PAGE_COUNTER_SHIFT].pending = 0;
 		}
 		bmc = bitmap_get_counter(counts, node,
 					 block,
@@ -1345,40 +1683,30 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 			bitmap->allclean = 0;
 		}
 	}
-	spin_unlock_irq(&counts->lock);
+	if (lock)
+		spin_unlock_irq(lock);
 
 	/* Now start writeout on any page in NEEDWRITE that isn't DIRTY.
 	 * DIRTY pages need to be written by bitmap_unplug so it can wait
 	 * for them.
 	 * If we find any DIRTY page we stop there and let bitmap_unplug
 	 * handle all the rest.  This is important in the case where
-	 * the first blocking holds the superblock and it has been updated.
-	 * We mustn't write any other blocks before the superblock.
+	 * the first blocking holds the node's event counter and it has
+	 * been updated. We mustn't write any other blocks before it.
 	 */
-	for (j = 0;
+	for (j = next_attr_page(bitmap, start, end);
 	     j < end && !test_bit(BITMAP_STALE, &info->flags);
-	     ) {
+	     j = next_attr_page(bitmap, j + 1, end)) {
 
 		if (test_page_attr(bitmap, j,
 				   BITMAP_PAGE_DIRTY))
 			/* bitmap_unplug will handle the rest */
 			break;
 		if (test_and_clear_page_attr(bitmap, j,
-					     BITMAP_PAGE_NEEDWRITE)) {
-			if (!j) {
-				md_lock_super(mddev, DLM_LOCK_EX);
-			}
-			write_page(bitmap, bitmap->storage.filemap[j], 0);
-			if (!j) {
-				md_unlock_super(mddev);
-			}
-		}
-		if (!j) {
-			j = start;
-		} else {
-			j++;
-		}
+					     BITMAP_PAGE_NEEDWRITE))
+			add_page_run(bitmap, &run, j);
 	}
+	flush_page_run(bitmap, &run);
 
  done:
 	if (bitmap->allclean == 0)
@@ -1390,25 +1718,36 @@ void bitmap_daemon_work(struct mddev *mddev, int node)
 static bitmap_counter_t *bitmap_get_counter(struct bitmap_counts *bitmap, int node,
 					    sector_t offset, sector_t *blocks,
 					    int create)
-__releases(bitmap->lock)
-__acquires(bitmap->lock)
+__releases(lock)
+__acquires(lock)
 {
-	/* If 'create', we might release the lock and reclaim it.
+	/* The counter lock for offset must be held.
+	 * If 'create', we might release the lock and reclaim it.
 	 * The lock must have been taken with interrupts enabled.
 	 * If !create, we don't release the lock.
 	 */
 	sector_t chunk = offset >> bitmap->chunkshift;
 	unsigned long page = chunk >> PAGE_COUNTER_SHIFT;
 	unsigned long pageoff = (chunk & PAGE_COUNTER_MASK) << COUNTER_BYTE_SHIFT;
+	struct bitmap_page *bp;
 	sector_t csize;
 	int err;
 
-	page = bitmap->pages * node + page;
+	if (page >= bitmap->pages) {
+		/* past the end of this node's counters */
+		*blocks = ((sector_t)1) << (bitmap->chunkshift +
+					    PAGE_COUNTER_SHIFT);
+		return NULL;
+	}
 
-	err = bitmap_checkpage(bitmap, page, create);
+	err = bitmap_checkpage(bitmap, node, page, create, &bp);
 
-	if (bitmap->bp[page].hijacked ||
-	    bitmap->bp[page].map == NULL)
+	if (!bp)
+		/* node not tracked, nothing anywhere on this page */
+		csize = ((sector_t)1) << (bitmap->chunkshift +
+					  PAGE_COUNTER_SHIFT);
+	else if (bp[page].hijacked ||
+		 bp[page].map == NULL)
 		csize = ((sector_t)1) << (bitmap->chunkshift +
 					  PAGE_COUNTER_SHIFT - 1);
 	else
@@ -1420,15 +1759,15 @@ __acquires(bitmap->lock)
 
 	/* now locked ... */
 
-	if (bitmap->bp[page].hijacked) { /* hijacked pointer */
+	if (bp[page].hijacked) { /* hijacked pointer */
 		/* should we use the first or second counter field
 		 * of the hijacked pointer? */
 		int hi = (pageoff > PAGE_COUNTER_MASK);
 		return  &((bitmap_counter_t *)
-			  &bitmap->bp[page].map)[hi];
+			  &bp[page].map)[hi];
 	} else /* page is allocated */
 		return (bitmap_counter_t *)
-			&(bitmap->bp[page].map[pageoff]);
+			&(bp[page].map[pageoff]);
 }
 
 int bitmap_startwrite(struct bitmap *bitmap, int node, sector_t offset, unsigned long sectors, int behind)
@@ -1450,11 +1789,12 @@ int bitmap_startwrite(struct bitmap *bitmap, int node, sector_t offset, unsigned
 	while (sectors) {
 		sector_t blocks;
 		bitmap_counter_t *bmc;
+		spinlock_t *lock = bitmap_counter_lock(&bitmap->counts, offset);
 
-		spin_lock_irq(&bitmap->counts.lock);
+		spin_lock_irq(lock);
 		bmc = bitmap_get_counter(&bitmap->counts, node, offset, &blocks, 1);
 		if (!bmc) {
-			spin_unlock_irq(&bitmap->counts.lock);
+			spin_unlock_irq(lock);
 			return 0;
 		}
 
@@ -1466,7 +1806,7 @@ int bitmap_startwrite(struct bitmap *bitmap, int node, sector_t offset, unsigned
 			 */
 			prepare_to_wait(&bitmap->overflow_wait, &__wait,
 					TASK_UNINTERRUPTIBLE);
-			spin_unlock_irq(&bitmap->counts.lock);
+			spin_unlock_irq(lock);
 			schedule();
 			finish_wait(&bitmap->overflow_wait, &__wait);
 			continue;
@@ -1483,7 +1823,7 @@ int bitmap_startwrite(struct bitmap *bitmap, int node, sector_t offset, unsigned
 
 		(*bmc)++;
 
-		spin_unlock_irq(&bitmap->counts.lock);
+		spin_unlock_irq(lock);
 
 		offset += blocks;
 		if (sectors > blocks)
@@ -1514,11 +1854,12 @@ void bitmap_endwrite(struct bitmap *bitmap, int node, sector_t offset, unsigned
 		sector_t blocks;
 		unsigned long flags;
 		bitmap_counter_t *bmc;
+		spinlock_t *lock = bitmap_counter_lock(&bitmap->counts, offset);
 
-		spin_lock_irqsave(&bitmap->counts.lock, flags);
+		spin_lock_irqsave(lock, flags);
 		bmc = bitmap_get_counter(&bitmap->counts, node, offset, &blocks, 0);
 		if (!bmc) {
-			spin_unlock_irqrestore(&bitmap->counts.lock, flags);
+			spin_unlock_irqrestore(lock, flags);
 			return;
 		}
 
@@ -1540,7 +1881,7 @@ void bitmap_endwrite(struct bitmap *bitmap, int node, sector_t offset, unsigned
 			bitmap_set_pending(&bitmap->counts, node, offset);
 			bitmap->allclean = 0;
 		}
-		spin_unlock_irqrestore(&bitmap->counts.lock, flags);
+		spin_unlock_irqrestore(lock, flags);
 		offset += blocks;
 		if (sectors > blocks)
 			sectors -= blocks;
@@ -1554,12 +1895,14 @@ static int __bitmap_start_sync(struct bitmap *bitmap, int node, sector_t offset,
 			       int degraded)
 {
 	bitmap_counter_t *bmc;
+	spinlock_t *lock;
 	int rv;
 	if (bitmap == NULL) {/* FIXME or bitmap set as 'failed' */
 		*blocks = 1024;
 		return 1; /* always resync if no bitmap */
 	}
-	spin_lock_irq(&bitmap->counts.lock);
+	lock = bitmap_counter_lock(&bitmap->counts, offset);
+	spin_lock_irq(lock);
 	bmc = bitmap_get_counter(&bitmap->counts, node, offset, blocks, 0);
 	rv = 0;
 	if (bmc) {
@@ -1574,7 +1917,7 @@ static int __bitmap_start_sync(struct bitmap *bitmap, int node, sector_t offset,
 			}
 		}
 	}
-	spin_unlock_irq(&bitmap->counts.lock);
+	spin_unlock_irq(lock);
 	return rv;
 }
 
@@ -1606,12 +1949,14 @@ void bitmap_end_sync(struct bitmap *bitmap, int node, sector_t offset, sector_t
 {
 	bitmap_counter_t *bmc;
 	unsigned long flags;
+	spinlock_t *lock;
 
 	if (bitmap == NULL) {
 		*blocks = 1024;
 		return;
 	}
-	spin_lock_irqsave(&bitmap->counts.lock, flags);
+	lock = bitmap_counter_lock(&bitmap->counts, offset);
+	spin_lock_irqsave(lock, flags);
 	bmc = bitmap_get_counter(&bitmap->counts, node, offset, blocks, 0);
 	if (bmc == NULL)
 		goto unlock;
@@ -1629,7 +1974,7 @@ void bitmap_end_sync(struct bitmap *bitmap, int node, sector_t offset, sector_t
 		}
 	}
  unlock:
-	spin_unlock_irqrestore(&bitmap->counts.lock, flags);
+	spin_unlock_irqrestore(lock, flags);
 }
 EXPORT_SYMBOL(bitmap_end_sync);
 
@@ -1680,19 +2025,194 @@ void bitmap_cond_end_sync(struct bitmap *bitmap, int node, sector_t sector)
 }
 EXPORT_SYMBOL(bitmap_cond_end_sync);
 
-static void bitmap_set_memory_bits(struct bitmap *bitmap, int node, sector_t offset, int needed)
+/*
+ * The *_sync_nodes variants work on every bitmap in the nodes mask in
+ * one pass, taking the counter lock once per chunk rather than once per
+ * chunk per bitmap. A chunk needs sync if any of the bitmaps needs it,
+ * and *blocks is the smallest extent over all of them so the answer
+ * holds for the whole range.
+ */
+static int __bitmap_start_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+				     sector_t offset, sector_t *blocks,
+				     int degraded)
 {
-	/* For each chunk covered by any of these sectors, set the
-	 * counter to 2 and possibly set resync_needed.  They should all
-	 * be 0 at this point
+	bitmap_counter_t *bmc;
+	sector_t b, next;
+	int node;
+	int rv = 0;
+	spinlock_t *lock = bitmap_counter_lock(&bitmap->counts, offset);
+
+	*blocks = ((sector_t)1) << bitmap->counts.chunkshift;
+	*blocks -= offset & (*blocks - 1);
+	spin_lock_irq(lock);
+	next = bitmap_next_dirty(&bitmap->counts, nodes, offset);
+	if (next > offset) {
+		/* nothing to sync up to the next dirty page */
+		spin_unlock_irq(lock);
+		*blocks = next - offset;
+		return 0;
+	}
+	for_each_set_bit(node, nodes, bitmap->mddev->bitmap_info.nodes) {
+		bmc = bitmap_get_counter(&bitmap->counts, node, offset, &b, 0);
+		if (b < *blocks)
+			*blocks = b;
+		if (!bmc)
+			continue;
+		if (RESYNC(*bmc))
+			rv = 1;
+		else if (NEEDED(*bmc)) {
+			rv = 1;
+			if (!degraded) { /* don't set/clear bits if degraded */
+				*bmc |= RESYNC_MASK;
+				*bmc &= ~NEEDED_MASK;
+			}
+		}
+	}
+	spin_unlock_irq(lock);
+	return rv;
+}
+
+int bitmap_start_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+			    sector_t offset, sector_t *blocks, int degraded)
+{
+	/* like bitmap_start_sync, report on whole pages */
+	int rv = 0;
+	sector_t blocks1;
+
+	if (bitmap == NULL) {/* FIXME or bitmap set as 'failed' */
+		*blocks = 1024;
+		return 1; /* always resync if no bitmap */
+	}
+	*blocks = 0;
+	while (*blocks < (PAGE_SIZE>>9)) {
+		rv |= __bitmap_start_sync_nodes(bitmap, nodes, offset,
+						&blocks1, degraded);
+		offset += blocks1;
+		*blocks += blocks1;
+	}
+	return rv;
+}
+EXPORT_SYMBOL(bitmap_start_sync_nodes);
+
+void bitmap_end_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+			   sector_t offset, sector_t *blocks, int aborted)
+{
+	bitmap_counter_t *bmc;
+	unsigned long flags;
+	sector_t b, next;
+	int node;
+	spinlock_t *lock;
+
+	if (bitmap == NULL) {
+		*blocks = 1024;
+		return;
+	}
+	*blocks = ((sector_t)1) << bitmap->counts.chunkshift;
+	*blocks -= offset & (*blocks - 1);
+	lock = bitmap_counter_lock(&bitmap->counts, offset);
+	spin_lock_irqsave(lock, flags);
+	next = bitmap_next_dirty(&bitmap->counts, nodes, offset);
+	if (next > offset) {
+		/* no RESYNC bits up to the next dirty page */
+		spin_unlock_irqrestore(lock, flags);
+		*blocks = next - offset;
+		return;
+	}
+	for_each_set_bit(node, nodes, bitmap->mddev->bitmap_info.nodes) {
+		bmc = bitmap_get_counter(&bitmap->counts, node, offset, &b, 0);
+		if (b < *blocks)
+			*blocks = b;
+		if (bmc == NULL || !RESYNC(*bmc))
+			continue;
+		*bmc &= ~RESYNC_MASK;
+
+		if (!NEEDED(*bmc) && aborted)
+			*bmc |= NEEDED_MASK;
+		else {
+			if (*bmc <= 2) {
+				bitmap_set_pending(&bitmap->counts, node, offset);
+				bitmap->allclean = 0;
+			}
+		}
+	}
+	spin_unlock_irqrestore(lock, flags);
+}
+EXPORT_SYMBOL(bitmap_end_sync_nodes);
+
+void bitmap_close_sync_nodes(struct bitmap *bitmap, unsigned long *nodes)
+{
+	sector_t sector = 0;
+	sector_t blocks;
+	if (!bitmap)
+		return;
+	while (sector < bitmap->mddev->resync_max_sectors) {
+		bitmap_end_sync_nodes(bitmap, nodes, sector, &blocks, 0);
+		sector += blocks;
+	}
+}
+EXPORT_SYMBOL(bitmap_close_sync_nodes);
+
+void bitmap_cond_end_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+				sector_t sector)
+{
+	sector_t s = 0;
+	sector_t blocks;
+
+	if (!bitmap)
+		return;
+	if (sector == 0) {
+		bitmap->last_end_sync = jiffies;
+		return;
+	}
+	if (time_before(jiffies, (bitmap->last_end_sync
+				  + bitmap->mddev->bitmap_info.daemon_sleep)))
+		return;
+	wait_event(bitmap->mddev->recovery_wait,
+		   atomic_read(&bitmap->mddev->recovery_active) == 0);
+
+	bitmap->mddev->curr_resync_completed = sector;
+	set_bit(MD_CHANGE_CLEAN, &bitmap->mddev->flags);
+	sector &= ~((1ULL << bitmap->counts.chunkshift) - 1);
+	while (s < sector && s < bitmap->mddev->resync_max_sectors) {
+		bitmap_end_sync_nodes(bitmap, nodes, s, &blocks, 0);
+		s += blocks;
+	}
+	bitmap->last_end_sync = jiffies;
+	sysfs_notify(&bitmap->mddev->kobj, NULL, "sync_completed");
+}
+EXPORT_SYMBOL(bitmap_cond_end_sync_nodes);
+
+/* lo..hi was resynced by another node, clear it as if we had done it */
+void bitmap_skip_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+			    sector_t lo, sector_t hi)
+{
+	sector_t blocks;
+
+	if (!bitmap)
+		return;
+	while (lo < hi) {
+		__bitmap_start_sync_nodes(bitmap, nodes, lo, &blocks, 0);
+		bitmap_end_sync_nodes(bitmap, nodes, lo, &blocks, 0);
+		lo += blocks;
+	}
+}
+EXPORT_SYMBOL(bitmap_skip_sync_nodes);
+
+static void bitmap_set_memory_bits(struct bitmap *bitmap, int node, sector_t offset, int needed)
+{
+	/* For each chunk covered by any of these sectors, set the
+	 * counter to 2 and possibly set resync_needed.  They should all
+	 * be 0 at this point
 	 */
 
 	sector_t secs;
 	bitmap_counter_t *bmc;
-	spin_lock_irq(&bitmap->counts.lock);
+	spinlock_t *lock = bitmap_counter_lock(&bitmap->counts, offset);
+
+	spin_lock_irq(lock);
 	bmc = bitmap_get_counter(&bitmap->counts, node, offset, &secs, 1);
 	if (!bmc) {
-		spin_unlock_irq(&bitmap->counts.lock);
+		spin_unlock_irq(lock);
 		return;
 	}
 	if (!*bmc) {
@@ -1701,7 +2221,50 @@ static void bitmap_set_memory_bits(struct bitmap *bitmap, int node, sector_t off
 		bitmap_set_pending(&bitmap->counts, node, offset);
 		bitmap->allclean = 0;
 	}
-	spin_unlock_irq(&bitmap->counts.lock);
+	spin_unlock_irq(lock);
+}
+
+/*
+ * bitmap_set_memory_bits for n consecutive chunks, as found set on disk.
+ * The counter lock is taken once per counter page rather than per chunk.
+ * Chunks ending before 'start' are not marked as needing resync.
+ */
+static void bitmap_set_memory_range(struct bitmap *bitmap, int node,
+				    unsigned long chunk, unsigned long n,
+				    sector_t start)
+{
+	struct bitmap_counts *counts = &bitmap->counts;
+	unsigned long end = chunk + n;
+	spinlock_t *lock = NULL;
+	bitmap_counter_t *bmc;
+	sector_t offset, secs;
+	int needed;
+
+	while (chunk < end) {
+		offset = (sector_t)chunk << counts->chunkshift;
+		if (!lock) {
+			lock = bitmap_counter_lock(counts, offset);
+			spin_lock_irq(lock);
+		}
+		bmc = bitmap_get_counter(counts, node, offset, &secs, 1);
+		if (!bmc)
+			break;
+		if (!*bmc) {
+			needed = ((sector_t)(chunk + 1) << counts->chunkshift
+				  >= start);
+			*bmc = 2 | (needed ? NEEDED_MASK : 0);
+			bitmap_count_page(counts, node, offset, 1);
+			bitmap_set_pending(counts, node, offset);
+			bitmap->allclean = 0;
+		}
+		chunk++;
+		if (!(chunk & PAGE_COUNTER_MASK)) {
+			spin_unlock_irq(lock);
+			lock = NULL;
+		}
+	}
+	if (lock)
+		spin_unlock_irq(lock);
 }
 
 /* dirty the memory and file bits for bitmap chunks "s" to "e" */
@@ -1744,6 +2307,28 @@ void bitmap_flush(struct mddev *mddev)
 	bitmap->daemon_lastrun -= sleep;
 	bitmap_daemon_work(mddev, mddev->bitmap->used);
 	bitmap_update_sb(bitmap);
+	bitmap_write_sb(bitmap);
+}
+
+/* free the counter pages of every node that has them */
+static void bitmap_free_counters(struct bitmap_counts *counts)
+{
+	struct bitmap_page *bp;
+	unsigned long k;
+	int node;
+
+	if (!counts->bp)
+		return;
+	for (node = 0; node < counts->nodes; node++) {
+		bp = counts->bp[node];
+		if (!bp)
+			continue;
+		for (k = 0; k < counts->pages; k++)
+			if (bp[k].map && !bp[k].hijacked)
+				kfree(bp[k].map);
+		kfree(bp);
+	}
+	kfree(counts->bp);
 }
 
 /*
@@ -1751,8 +2336,6 @@ void bitmap_flush(struct mddev *mddev)
  */
 static void bitmap_free(struct bitmap *bitmap)
 {
-	unsigned long k, pages;
-	struct bitmap_page *bp;
 
 	if (!bitmap) /* there was no bitmap */
 		return;
@@ -1764,17 +2347,65 @@ static void bitmap_free(struct bitmap *bitmap)
 	/* release the bitmap file  */
 	bitmap_file_unmap(&bitmap->storage);
 
-	bp = bitmap->counts.bp;
-	pages = bitmap->counts.pages;
-
 	/* free all allocated memory */
+	bitmap_free_counters(&bitmap->counts);
+	kfree(bitmap->counts.dirty_pages);
+	kfree(bitmap->lock_events);
+	kfree(bitmap->ex_tried);
+	kfree(bitmap);
+}
 
-	if (bp) /* deallocate the page memory */
-		for (k = 0; k < pages; k++)
-			if (bp[k].map && !bp[k].hijacked)
-				kfree(bp[k].map);
+/*
+ * Drop the in-memory counters of another node's bitmap once we no
+ * longer hold it for recovery. They are allocated again by
+ * bitmap_checkpage() if the node's bits are ever loaded back.
+ */
+void bitmap_free_node(struct bitmap *bitmap, int node)
+{
+	struct bitmap_counts *counts;
+	struct bitmap_page *bp;
+	unsigned long k;
+	int i;
+
+	if (!bitmap || node == bitmap->used)
+		return;
+	/* a load still in flight would offer it to recovery again */
+	if (bitmap->node_load) {
+		cancel_delayed_work_sync(&bitmap->node_load[node].work);
+		clear_bit(node, bitmap->mddev->avail_bitmap);
+	}
+	counts = &bitmap->counts;
+	if (node >= counts->nodes)
+		return;
+	bp = xchg(&counts->bp[node], NULL);
+	if (!bp)
+		return;
+	/* wait out anyone still looking at the old array */
+	for (i = 0; i < BITMAP_COUNTER_LOCKS; i++) {
+		spin_lock_irq(&counts->locks[i]);
+		spin_unlock_irq(&counts->locks[i]);
+	}
+	for (k = 0; k < counts->pages; k++) {
+		if (bp[k].map && !bp[k].hijacked)
+			kfree(bp[k].map);
+		else
+			atomic_long_dec(&counts->missing_pages);
+		clear_bit(counts->pages * node + k, counts->dirty_pages);
+	}
 	kfree(bp);
-	kfree(bitmap);
+}
+EXPORT_SYMBOL(bitmap_free_node);
+
+static void bitmap_free_locks(struct mddev *mddev)
+{
+	int i;
+
+	if (!mddev->dlm_md_bitmap)
+		return;
+	for (i = 0; i < mddev->bitmap_info.nodes; i++)
+		deinit_lock_resource(mddev->dlm_md_bitmap[i]);
+	kfree(mddev->dlm_md_bitmap);
+	mddev->dlm_md_bitmap = NULL;
 }
 
 void bitmap_destroy(struct mddev *mddev)
@@ -1787,6 +2418,15 @@ void bitmap_destroy(struct mddev *mddev)
 	mutex_lock(&mddev->bitmap_info.mutex);
 	mddev->bitmap = NULL; /* disconnect from the md device */
 	mutex_unlock(&mddev->bitmap_info.mutex);
+	cancel_delayed_work_sync(&bitmap->lock_work);
+	if (bitmap->node_load) {
+		int i;
+
+		for (i = 0; i < mddev->bitmap_info.nodes; i++)
+			cancel_delayed_work_sync(&bitmap->node_load[i].work);
+		kfree(bitmap->node_load);
+		bitmap->node_load = NULL;
+	}
 	if (mddev->avail_bitmap) {
 		kfree(mddev->avail_bitmap);
 		mddev->avail_bitmap = NULL;
@@ -1802,6 +2442,8 @@ void bitmap_destroy(struct mddev *mddev)
 		bitmap->events = NULL;
 	}
 
+	bitmap_free_locks(mddev);
+
 	if (mddev->thread)
 		mddev->thread->timeout = MAX_SCHEDULE_TIMEOUT;
 
@@ -1811,6 +2453,8 @@ void bitmap_destroy(struct mddev *mddev)
 	bitmap_free(bitmap);
 }
 
+static void bitmap_lock_work(struct work_struct *ws);
+
 /*
  * initialize the bitmap structure
  * if this returns an error, bitmap_destroy must be called to do clean up
@@ -1838,11 +2482,14 @@ int bitmap_create(struct mddev *mddev)
 	if (!bitmap)
 		return -ENOMEM;
 
-	spin_lock_init(&bitmap->counts.lock);
+	for (i = 0; i < BITMAP_COUNTER_LOCKS; i++)
+		spin_lock_init(&bitmap->counter_locks[i]);
+	bitmap->counts.locks = bitmap->counter_locks;
 	atomic_set(&bitmap->pending_writes, 0);
 	init_waitqueue_head(&bitmap->write_wait);
 	init_waitqueue_head(&bitmap->overflow_wait);
 	init_waitqueue_head(&bitmap->behind_wait);
+	INIT_DELAYED_WORK(&bitmap->lock_work, bitmap_lock_work);
 	bitmap->used = -1;
 
 	bitmap->mddev = mddev;
@@ -1896,140 +2543,84 @@ int bitmap_create(struct mddev *mddev)
 	printk(KERN_INFO "created bitmap (%lu pages) for device %s\n",
 	       bitmap->counts.pages, bmname(bitmap));
 
-	mddev->bitmap = bitmap;
-	if (test_bit(BITMAP_WRITE_ERROR, &bitmap->flags)) {
-		return -EIO;
-	}
-	
 	err = -ENOMEM;
-	mddev->avail_bitmap = kzalloc(mddev->bitmap_info.nodes * sizeof(int), GFP_KERNEL);
+	mddev->avail_bitmap = kzalloc(BITS_TO_LONGS(mddev->bitmap_info.nodes) *
+				      sizeof(unsigned long), GFP_KERNEL);
 	if (!mddev->avail_bitmap) {
 		goto error;
 	}
 
-	mddev->reclaim_bitmap = kzalloc(mddev->bitmap_info.nodes * sizeof(int), GFP_KERNEL);
+	mddev->reclaim_bitmap = kzalloc(BITS_TO_LONGS(mddev->bitmap_info.nodes) *
+					sizeof(unsigned long), GFP_KERNEL);
 	if (!mddev->reclaim_bitmap) {
-		kfree(mddev->avail_bitmap);
-		mddev->avail_bitmap = NULL;
 		goto error;
 	}
 
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		mddev->avail_bitmap[i] = -1;
-		mddev->reclaim_bitmap[i] = -1;
-	}
-	
+
 	/* allocate event_info for each bitmap */
 	bitmap->events = kzalloc(sizeof(struct events_info) * mddev->bitmap_info.nodes,
 				GFP_KERNEL);
 	if (!bitmap->events) {
-		kfree(mddev->avail_bitmap);
-		kfree(mddev->reclaim_bitmap);
-		mddev->avail_bitmap = NULL;
-		mddev->reclaim_bitmap = NULL;
 		goto error;
 	}
 
-	/* now initialize bitmap lock resources. */
+	bitmap->node_load = kzalloc(sizeof(struct bitmap_node_load) *
+				    mddev->bitmap_info.nodes, GFP_KERNEL);
+	if (!bitmap->node_load) {
+		goto error;
+	}
+	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
+		INIT_DELAYED_WORK(&bitmap->node_load[i].work, bitmap_load_node_work);
+		bitmap->node_load[i].bitmap = bitmap;
+		bitmap->node_load[i].node = i;
+	}
+
+	bitmap->lock_events = kzalloc(BITS_TO_LONGS(mddev->bitmap_info.nodes) *
+				      sizeof(unsigned long), GFP_KERNEL);
+	bitmap->ex_tried = kzalloc(BITS_TO_LONGS(mddev->bitmap_info.nodes) *
+				   sizeof(unsigned long), GFP_KERNEL);
+	if (!bitmap->lock_events || !bitmap->ex_tried) {
+		goto error;
+	}
+
+	/* now initialize bitmap lock resources, indexed by bitmap number. */
+	mddev->dlm_md_bitmap = kzalloc(mddev->bitmap_info.nodes *
+				       sizeof(struct dlm_lock_resource *),
+				       GFP_KERNEL);
+	if (!mddev->dlm_md_bitmap) {
+		goto error;
+	}
 	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
 		memset(name, 0, 11);
 		sprintf(name, "bitmap%4d", i);
 		res = init_lock_resource(mddev, name);
 		if (!res) {
-			while (!list_empty(&mddev->dlm_md_bitmap)) {
-				res = list_entry(mddev->dlm_md_bitmap.next,
-						struct dlm_lock_resource,
-						list);
-				list_del(&res->list);
-				deinit_lock_resource(res);
-			}
-			kfree(mddev->avail_bitmap);
-			kfree(mddev->reclaim_bitmap);
-			kfree(bitmap->events);
-			mddev->avail_bitmap = NULL;
-			mddev->reclaim_bitmap = NULL;
-			bitmap->events = NULL;
 			goto error;
 		}
 		res->index = i;
-		list_add_tail(&res->list, &mddev->dlm_md_bitmap);
+		mddev->dlm_md_bitmap[i] = res;
 	}
-	err = 0;
+
+	mddev->bitmap = bitmap;
+	return test_bit(BITMAP_WRITE_ERROR, &bitmap->flags) ? -EIO : 0;
 
  error:
+	bitmap_free_locks(mddev);
+	kfree(mddev->avail_bitmap);
+	kfree(mddev->reclaim_bitmap);
+	mddev->avail_bitmap = NULL;
+	mddev->reclaim_bitmap = NULL;
+	kfree(bitmap->events);
+	kfree(bitmap->node_load);
 	bitmap_free(bitmap);
 	return err;
 }
 
-int exist_in_avail_bitmap(struct mddev *mddev, int num)
-{
-	int i;
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->avail_bitmap[i] == num) {
-			return i;
-		}
-	}
-	return -1;
-}
-
-int bitmap_add_avail_bitmap(struct mddev *mddev, int num)
-{
-	int ret;
-	int i;
-	ret = exist_in_avail_bitmap(mddev, num);
-	if (ret < 0) {
-		for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-			if (mddev->avail_bitmap[i] == -1) {
-				mddev->avail_bitmap[i] = num;
-				return i;
-			}
-		}
-	}
-	return ret;
-}
-
-int exist_in_reclaim_bitmap(struct mddev *mddev, int num)
-{
-	int i;
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->reclaim_bitmap[i] == num) {
-			return i;
-		}
-	}
-	return -1;
-}
-
-int bitmap_add_reclaim_bitmap(struct mddev *mddev, int num)
-{
-	int ret;
-	int i;
-	ret = exist_in_reclaim_bitmap(mddev, num);
-	if (ret < 0) {
-		for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-			if (mddev->reclaim_bitmap[i] == -1) {
-				mddev->reclaim_bitmap[i] = num;
-				return i;
-			}
-		}
-	}
-	return ret;
-}
 struct dlm_lock_resource *find_bitmap_by_node(struct mddev *mddev, int node)
 {
-	int i = 0;
-	struct list_head *pos, *head;
-	struct dlm_lock_resource *res;
-	head = &mddev->dlm_md_bitmap;
-	pos = head->next;
-	while (i < node && pos->next != head) {
-		i++;
-		pos = pos->next;
-	}
-	if (i == node) {
-		res = list_entry(pos, struct dlm_lock_resource, list);
-		return res;
-	}
-	return NULL;
+	if (node < 0 || node >= mddev->bitmap_info.nodes || !mddev->dlm_md_bitmap)
+		return NULL;
+	return mddev->dlm_md_bitmap[node];
 }
 EXPORT_SYMBOL(find_bitmap_by_node);
 
@@ -2041,28 +2632,12 @@ void bitmap_ast(void *arg)
 	res = (struct dlm_lock_resource *)arg;
 	mddev = res->mddev;
 	res->finished = 1;
-	/* unlock successfully */
-	if (res->lksb.sb_status == -DLM_EUNLOCK) {
-		wake_up(&res->waiter);
-		return;
-	}
-	/* lock successfully. */
-	if (!res->lksb.sb_status) {
-		if (res->mode == DLM_LOCK_CR) {
-			mutex_lock(&mddev->avail_mutex);
-			/* may need to reload bitmap from 
-			 * disk somewhere. since this can be
-			 * node failure. */
-			bitmap_add_avail_bitmap(mddev, res->index);
-			mutex_unlock(&mddev->avail_mutex);
-			md_wakeup_thread(mddev->thread);
-		}
-		if (res->mode == DLM_LOCK_EX) {
-			mddev->bitmap->used = res->index;
-		}
-		if (res->mode == DLM_LOCK_PW) {
-			; /* nothing here? */
-		}
+	/* requests made by the state machine are finished there */
+	if ((res->state == BITMAP_LOCK_WAIT_CR ||
+	     res->state == BITMAP_LOCK_WAIT_EX ||
+	     res->state == BITMAP_LOCK_UNLOCKING) && mddev->bitmap) {
+		set_bit(res->index, mddev->bitmap->lock_events);
+		bitmap_kick_locks(mddev);
 	}
 	wake_up(&res->waiter);
 	return;
@@ -2072,24 +2647,17 @@ void bitmap_bast(void *arg, int mode)
 {
 	struct dlm_lock_resource *res;
 	struct mddev *mddev;
-	int index;
 
 	res = (struct dlm_lock_resource *)arg;
 	mddev = res->mddev;
 	res->finished = 2;
+	/* the lock work takes it out of the avail set once no resync is
+	 * working on it */
 	if (res->mode == DLM_LOCK_CR) {
-		mutex_lock(&mddev->reclaim_mutex);
-		bitmap_add_reclaim_bitmap(mddev, res->index);
-		mutex_unlock(&mddev->reclaim_mutex);
-		mutex_lock(&mddev->avail_mutex);
-		index = exist_in_avail_bitmap(mddev, res->index);
-		if (index >= 0) {
-			mddev->avail_bitmap[index] = -1;
-		}
-		mutex_unlock(&mddev->avail_mutex);
+		set_bit(res->index, mddev->reclaim_bitmap);
+		bitmap_kick_locks(mddev);
 	}
 	wake_up(&res->waiter);
-	md_wakeup_thread(mddev->thread);
 	return;
 }
 
@@ -2154,6 +2722,154 @@ int bitmap_lock_async(struct dlm_lock_resource *res)
 }
 EXPORT_SYMBOL(bitmap_lock_async);
 
+void bitmap_kick_locks(struct mddev *mddev)
+{
+	struct bitmap *bitmap = mddev->bitmap;
+
+	if (bitmap)
+		mod_delayed_work(system_wq, &bitmap->lock_work, 0);
+}
+EXPORT_SYMBOL(bitmap_kick_locks);
+
+/* ask for CR on a node's bitmap, granted once nobody holds it EX */
+static void bitmap_request_cr(struct dlm_lock_resource *res, uint32_t flags)
+{
+	res->mode = DLM_LOCK_CR;
+	res->flags = flags;
+	res->finished = 0;
+	res->state = BITMAP_LOCK_WAIT_CR;
+	memset(&res->lksb, 0, sizeof(struct dlm_lksb));
+	if (bitmap_lock_async(res)) {
+		printk(KERN_WARNING "request CR on bitmap %d failed!\n",
+		       res->index);
+		res->state = BITMAP_LOCK_IDLE;
+	}
+}
+
+/* move a lock on once the request it was waiting for has completed */
+static void bitmap_lock_event(struct bitmap *bitmap,
+			      struct dlm_lock_resource *res)
+{
+	struct mddev *mddev = bitmap->mddev;
+	int i = res->index;
+
+	switch (res->state) {
+	case BITMAP_LOCK_WAIT_CR:
+		if (res->lksb.sb_status) {
+			printk(KERN_WARNING "CR on bitmap %d failed: %d\n",
+			       i, res->lksb.sb_status);
+			res->state = BITMAP_LOCK_IDLE;
+			break;
+		}
+		/* its owner has gone, read in what it left first */
+		res->state = BITMAP_LOCK_LOADING;
+		schedule_delayed_work(&bitmap->node_load[i].work, 0);
+		break;
+	case BITMAP_LOCK_WAIT_EX:
+		if (!res->lksb.sb_status) {
+			res->state = BITMAP_LOCK_USED;
+			bitmap->used = i;
+			bitmap_zero(bitmap->ex_tried, mddev->bitmap_info.nodes);
+			wake_up(&mddev->bitmap_wait);
+			break;
+		}
+		/* refused, we still hold it CR */
+		res->mode = DLM_LOCK_CR;
+		res->state = BITMAP_LOCK_AVAIL;
+		set_bit(i, mddev->avail_bitmap);
+		break;
+	case BITMAP_LOCK_UNLOCKING:
+		/* its owner is back, stop tracking its counters and
+		 * wait for it to go away again.
+		 */
+		bitmap_free_node(bitmap, i);
+		bitmap_request_cr(res, 0);
+		break;
+	}
+}
+
+/*
+ * The bitmap lock state machine. bitmap_ast() and bitmap_bast() only
+ * record what happened and queue this, and none of the requests made
+ * here are waited for, so raid1d never blocks on the DLM.
+ */
+static void bitmap_lock_work(struct work_struct *ws)
+{
+	struct bitmap *bitmap = container_of(to_delayed_work(ws),
+					     struct bitmap, lock_work);
+	struct mddev *mddev = bitmap->mddev;
+	struct dlm_lock_resource *res;
+	int i, converting = 0;
+	/* resync keeps the avail set to itself and kicks us when done.
+	 * Until then the owners of the bitmaps it recovers are kept
+	 * waiting, their bits are still being worked on.
+	 */
+	int resyncing = !mutex_trylock(&mddev->avail_mutex);
+
+	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
+		res = mddev->dlm_md_bitmap[i];
+		if (test_and_clear_bit(i, bitmap->lock_events))
+			bitmap_lock_event(bitmap, res);
+		if (res->state == BITMAP_LOCK_WAIT_EX) {
+			/* see to the owner once the convert is done */
+			converting = 1;
+			continue;
+		}
+		if (resyncing || !test_and_clear_bit(i, mddev->reclaim_bitmap))
+			continue;
+		/* we are blocking its owner, hand it back */
+		if (res->state != BITMAP_LOCK_AVAIL &&
+		    res->state != BITMAP_LOCK_LOADING)
+			continue;
+		cancel_delayed_work_sync(&bitmap->node_load[i].work);
+		clear_bit(i, mddev->avail_bitmap);
+		res->state = BITMAP_LOCK_UNLOCKING;
+		res->finished = 0;
+		res->flags = 0;
+		if (dlm_unlock(mddev->dlm_md_lockspace, res->lksb.sb_lkid,
+			       0, &res->lksb, res)) {
+			printk(KERN_WARNING "unlock of bitmap %d failed!\n", i);
+			res->state = BITMAP_LOCK_AVAIL;
+			set_bit(i, mddev->avail_bitmap);
+		}
+	}
+
+	if (resyncing)
+		return;
+	/* choose one bitmap for our usage. */
+	if (bitmap->used != -1 || converting) {
+		mutex_unlock(&mddev->avail_mutex);
+		return;
+	}
+	for_each_set_bit(i, mddev->avail_bitmap, mddev->bitmap_info.nodes) {
+		res = mddev->dlm_md_bitmap[i];
+		if (res->state != BITMAP_LOCK_AVAIL ||
+		    test_bit(i, bitmap->ex_tried))
+			continue;
+		clear_bit(i, mddev->avail_bitmap);
+		set_bit(i, bitmap->ex_tried);
+		res->mode = DLM_LOCK_EX;
+		res->flags = DLM_LKF_CONVERT | DLM_LKF_NOQUEUE;
+		res->finished = 0;
+		res->state = BITMAP_LOCK_WAIT_EX;
+		if (!bitmap_lock_async(res)) {
+			converting = 1;
+			break;
+		}
+		res->mode = DLM_LOCK_CR;
+		res->state = BITMAP_LOCK_AVAIL;
+		set_bit(i, mddev->avail_bitmap);
+	}
+	mutex_unlock(&mddev->avail_mutex);
+	if (!converting && !bitmap_empty(mddev->avail_bitmap,
+					 mddev->bitmap_info.nodes)) {
+		/* every one refused, go round them again later */
+		bitmap_zero(bitmap->ex_tried, mddev->bitmap_info.nodes);
+		queue_delayed_work(system_wq, &bitmap->lock_work,
+				   mddev->bitmap_info.daemon_sleep);
+	}
+}
+
 int bitmap_load(struct mddev *mddev)
 {
 	int err = 0;
@@ -2161,7 +2877,6 @@ int bitmap_load(struct mddev *mddev)
 	sector_t sector = 0;
 	struct bitmap *bitmap = mddev->bitmap;
 	int i;
-	struct list_head *pos;
 	int ret;
 	struct events_info *info;
 
@@ -2214,37 +2929,45 @@ int bitmap_load(struct mddev *mddev)
 		err = -EIO;
 	/* here, we start to do lock work
 	 * and choose one bitmap to use.
+	 * Probe every bitmap with a NOQUEUE CR at once, so this costs
+	 * one round trip however many nodes there are.
 	 */
-	pos = mddev->dlm_md_bitmap.next;
 	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		/* try unblock CR lock first. */
 		struct dlm_lock_resource *res;
-		res = list_entry(pos, struct dlm_lock_resource, list);
+		res = mddev->dlm_md_bitmap[i];
 		res->mode = DLM_LOCK_CR;
 		res->flags = DLM_LKF_NOQUEUE | DLM_LKF_PERSISTENT;
 		res->finished = 0;
-		ret = bitmap_lock_sync(res);
-		if (ret == -EAGAIN) {
+		memset(&res->lksb, 0, sizeof(struct dlm_lksb));
+		ret = bitmap_lock_async(res);
+		if (ret) {
+			/* nothing to wait for */
+			res->finished = 1;
+			res->lksb.sb_status = ret;
+		}
+	}
+	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
+		struct dlm_lock_resource *res;
+		res = mddev->dlm_md_bitmap[i];
+		/* a bast may already have followed the ast */
+		wait_event(res->waiter, res->finished);
+		ret = res->lksb.sb_status;
+		if (!ret) {
+			/* nobody owns it, its bits are already in */
+			res->state = BITMAP_LOCK_AVAIL;
+			set_bit(i, mddev->avail_bitmap);
+		} else if (ret == -EAGAIN) {
 			/* already taken care of by someone else.
 			 * do async lock. */
-			res->mode = DLM_LOCK_CR;
-			res->flags = DLM_LKF_PERSISTENT;
-			memset(&res->lksb, 0, sizeof(struct dlm_lksb));
-			ret = bitmap_lock_async(res);
-			if (!ret) {
-				printk(KERN_WARNING "async lock for bitmap %s failed!\n",
-					res->name);
-			}
-		}
-		if (ret && ret != -EAGAIN) {
-			printk(KERN_WARNING "sync lock for bitmap %s failed!\n",
-				res->name);
+			bitmap_request_cr(res, DLM_LKF_PERSISTENT);
+		} else {
+			printk(KERN_WARNING "lock for bitmap %s failed: %d\n",
+				res->name, ret);
 		}
-		pos = pos->next;
-		/* successfully locked. */
-		/* put all bitmap choose and resync determination into 
-		 * raid1d. */
 	}
+	/* bitmap choose is up to the lock state machine. */
+	md_wakeup_thread(mddev->thread);
+	bitmap_kick_locks(mddev);
 out:
 	return err;
 }
@@ -2252,21 +2975,27 @@ EXPORT_SYMBOL_GPL(bitmap_load);
 
 void bitmap_status(struct seq_file *seq, struct bitmap *bitmap)
 {
-	unsigned long chunk_kb;
+	unsigned long chunk_kb, pages;
 	struct bitmap_counts *counts;
+	int node;
 
 	if (!bitmap)
 		return;
 
 	counts = &bitmap->counts;
+	/* only nodes whose counters are allocated */
+	pages = 0;
+	for (node = 0; node < counts->nodes; node++)
+		if (ACCESS_ONCE(counts->bp[node]))
+			pages += counts->pages;
+	pages -= atomic_long_read(&counts->missing_pages);
 
 	chunk_kb = bitmap->mddev->bitmap_info.chunksize >> 10;
 	seq_printf(seq, "bitmap: %lu/%lu pages [%luKB], "
 		   "%lu%s chunk",
-		   counts->pages - counts->missing_pages,
-		   counts->pages,
-		   (counts->pages - counts->missing_pages)
-		   << (PAGE_SHIFT - 10),
+		   pages,
+		   counts->pages * counts->nodes,
+		   pages << (PAGE_SHIFT - 10),
 		   chunk_kb ? chunk_kb : bitmap->mddev->bitmap_info.chunksize,
 		   chunk_kb ? "KB" : "B");
 	if (bitmap->storage.file) {
@@ -2299,7 +3028,10 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	int chunkshift;
 	int ret = 0;
 	long pages, all_pages;
-	struct bitmap_page *new_bp;
+	struct bitmap_page **new_bp;
+	long allocated = 0;
+	unsigned long *new_dirty;
+	spinlock_t *lock;
 
 	if (chunksize == 0) {
 		/* If there is enough space, leave the chunk size unchanged,
@@ -2335,7 +3067,7 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	chunks = DIV_ROUND_UP_SECTOR_T(blocks, 1 << chunkshift);
 	/* chunks in bytes */
 	bitmap_len = DIV_ROUND_UP_SECTOR_T(chunks, 8);
-	/* chunks plus per-node counter. 32 bytes*/
+	/* chunks plus the per-node counter page */
 	bitmap_len += PER_NODE_COUNTER;
 	/* round up to 4k. */
 	bitmap_len = DIV_ROUND_UP_SECTOR_T(bitmap_len, 4096);
@@ -2350,16 +3082,32 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 					   !bitmap->mddev->bitmap_info.external);
 	if (ret)
 		goto err;
+	/* each node's region is a whole number of pages after the sb */
+	store.per_node_pages = (bitmap_len >> 3) /
+		bitmap->mddev->bitmap_info.nodes / PAGE_SIZE;
 
 	pages = DIV_ROUND_UP(chunks, PAGE_COUNTER_RATIO);
 	/* counters for all nodes */
 	all_pages = pages * bitmap->mddev->bitmap_info.nodes;
 
-	new_bp = kzalloc(all_pages * sizeof(*new_bp), GFP_KERNEL);
+	/* other nodes' counters are allocated when their bits are loaded,
+	 * only carry over the ones that exist now.
+	 */
+	new_bp = kzalloc(bitmap->mddev->bitmap_info.nodes * sizeof(*new_bp),
+			 GFP_KERNEL);
+	new_dirty = kzalloc(BITS_TO_LONGS(all_pages) * sizeof(unsigned long),
+			    GFP_KERNEL);
 	ret = -ENOMEM;
-	if (!new_bp) {
-		bitmap_file_unmap(&store);
-		goto err;
+	if (!new_bp || !new_dirty)
+		goto err_free;
+	for (node = 0; node < bitmap->mddev->bitmap_info.nodes; node++) {
+		if (!(node < bitmap->counts.nodes && bitmap->counts.bp[node]) &&
+		    !(node == bitmap->used && !init))
+			continue;
+		new_bp[node] = kzalloc(pages * sizeof(**new_bp), GFP_KERNEL);
+		if (!new_bp[node])
+			goto err_free;
+		allocated += pages;
 	}
 
 	if (!init)
@@ -2378,22 +3126,27 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	old_counts = bitmap->counts;
 	bitmap->counts.bp = new_bp;
 	bitmap->counts.pages = pages; /* pages per node. */
-	bitmap->counts.missing_pages = all_pages; /* all missing pages. */
+	atomic_long_set(&bitmap->counts.missing_pages, allocated);
 	bitmap->counts.chunkshift = chunkshift;
 	bitmap->counts.chunks = chunks; /* this is per node chunks. */
+	bitmap->counts.nodes = bitmap->mddev->bitmap_info.nodes;
+	bitmap->counts.dirty_pages = new_dirty;
 	bitmap->mddev->bitmap_info.chunksize = 1 << (chunkshift +
 						     BITMAP_BLOCK_SHIFT);
 
 	blocks = min(old_counts.chunks << old_counts.chunkshift,
 		     chunks << chunkshift);
 
-	spin_lock_irq(&bitmap->counts.lock);
-	/* iterate over all nodes counters. ?*/
+	/* iterate over the counters of every node we track */
 	for (node = 0; node < bitmap->mddev->bitmap_info.nodes; node++) {
+		if (node >= old_counts.nodes || !old_counts.bp[node])
+			continue;
 		for (block = 0; block < blocks; ) {
 			bitmap_counter_t *bmc_old, *bmc_new;
 			int set;
 
+			lock = bitmap_counter_lock(&bitmap->counts, block);
+			spin_lock_irq(lock);
 			bmc_old = bitmap_get_counter(&old_counts, node, block,
 						     &old_blocks, 0);
 			set = bmc_old && NEEDED(*bmc_old);
@@ -2420,14 +3173,19 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 				if (new_blocks < old_blocks)
 					old_blocks = new_blocks;
 			}
+			spin_unlock_irq(lock);
 			block += old_blocks;
 		}
 	}
 
 	if (!init) {
 		int i;
-		while (block < (chunks << chunkshift)) {
+		block = blocks;
+		while (bitmap->used != -1 && block < (chunks << chunkshift)) {
 			bitmap_counter_t *bmc;
+
+			lock = bitmap_counter_lock(&bitmap->counts, block);
+			spin_lock_irq(lock);
 			bmc = bitmap_get_counter(&bitmap->counts, bitmap->used, block,
 						 &new_blocks, 1);
 			if (bmc) {
@@ -2442,12 +3200,15 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 							   bitmap->used, block);
 				}
 			}
+			spin_unlock_irq(lock);
 			block += new_blocks;
 		}
 		for (i = 0; i < bitmap->storage.file_pages; i++)
 			set_page_attr(bitmap, i, BITMAP_PAGE_DIRTY);
 	}
-	spin_unlock_irq(&bitmap->counts.lock);
+
+	bitmap_free_counters(&old_counts);
+	kfree(old_counts.dirty_pages);
 
 	if (!init) {
 		bitmap_unplug(bitmap);
@@ -2456,6 +3217,14 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	ret = 0;
 err:
 	return ret;
+err_free:
+	if (new_bp)
+		for (node = 0; node < bitmap->mddev->bitmap_info.nodes; node++)
+			kfree(new_bp[node]);
+	kfree(new_bp);
+	kfree(new_dirty);
+	bitmap_file_unmap(&store);
+	return ret;
 }
 EXPORT_SYMBOL_GPL(bitmap_resize);
 
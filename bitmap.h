@@ -186,20 +186,48 @@ struct bitmap_page {
 	unsigned int  count:30;
 };
 
+#define BITMAP_COUNTER_LOCKS 64
+
+/* where each node's bitmap lock is, see bitmap_lock_work() */
+enum bitmap_lock_state {
+	BITMAP_LOCK_IDLE = 0,	/* nothing held or asked for */
+	BITMAP_LOCK_WAIT_CR,	/* CR asked for, not granted yet */
+	BITMAP_LOCK_LOADING,	/* CR granted, reading the node's bits */
+	BITMAP_LOCK_AVAIL,	/* CR held, in avail_bitmap */
+	BITMAP_LOCK_WAIT_EX,	/* converting to EX to use it ourselves */
+	BITMAP_LOCK_USED,	/* EX held, this is bitmap->used */
+	BITMAP_LOCK_UNLOCKING,	/* handed back, CR is asked again after */
+};
+
+/* reads a failed node's bits into memory, one per node */
+struct bitmap_node_load {
+	struct delayed_work work;
+	struct bitmap *bitmap;
+	int node;
+};
+
 /* the main bitmap structure - one per mddev */
 struct bitmap {
 
+	/* counter locks, hashed by page within a node.  Kept out of
+	 * bitmap_counts so bitmap_resize can copy that by value. */
+	spinlock_t counter_locks[BITMAP_COUNTER_LOCKS];
+
 	struct bitmap_counts {
-		spinlock_t lock;
-		struct bitmap_page *bp;
+		spinlock_t *locks;		/* bitmap->counter_locks */
+		struct bitmap_page **bp;	/* per-node counter pages, NULL
+						 * for nodes we don't track */
 		unsigned long pages;		/* total number of pages
 						 * in the bitmap per node */
-		unsigned long missing_pages;	/* number of pages
-						 * not yet allocated all nodes*/
+		atomic_long_t missing_pages;	/* number of pages not yet
+						 * allocated in tracked nodes */
 		unsigned long chunkshift;	/* chunksize = 2^chunkshift
 						 * (for bitops) */
 		unsigned long chunks;		/* Total number of data
 						 * chunks for the array */
+		int nodes;			/* nodes with counters in bp */
+		unsigned long *dirty_pages;	/* a bit per page in bp, set
+						 * while its count is non-zero */
 	} counts;
 
 	struct mddev *mddev; /* the md device that the bitmap is for */
@@ -208,6 +236,11 @@ struct bitmap {
 	int need_sync;
 	int used;            /* indicating which bitmap we are using. */
 	struct events_info *events; /* events info for each bitmap. */
+	struct bitmap_node_load *node_load; /* loads of other nodes' bits */
+	/* bitmap lock state machine, run from a workqueue */
+	struct delayed_work lock_work;
+	unsigned long *lock_events;	/* locks with a request completed */
+	unsigned long *ex_tried;	/* refused EX since last success */
 
 	struct bitmap_storage {
 		struct file *file;		/* backing disk file */
@@ -218,6 +251,8 @@ struct bitmap {
 						 * the file */
 		unsigned long *filemap_attr;	/* attributes associated
 						 * w/ filemap pages */
+		unsigned long *attr_pages;	/* a bit per filemap page
+						 * that may have attributes */
 		unsigned long file_pages;	/* number of pages in the file*/
 		unsigned long per_node_pages;
 		unsigned long bytes;		/* total bytes in the bitmap */
@@ -273,9 +308,20 @@ int bitmap_start_sync(struct bitmap *bitmap, int node, sector_t offset, sector_t
 void bitmap_end_sync(struct bitmap *bitmap, int node, sector_t offset, sector_t *blocks, int aborted);
 void bitmap_close_sync(struct bitmap *bitmap, int node);
 void bitmap_cond_end_sync(struct bitmap *bitmap, int node, sector_t sector);
+int bitmap_start_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+			    sector_t offset, sector_t *blocks, int degraded);
+void bitmap_end_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+			   sector_t offset, sector_t *blocks, int aborted);
+void bitmap_close_sync_nodes(struct bitmap *bitmap, unsigned long *nodes);
+void bitmap_cond_end_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+				sector_t sector);
+void bitmap_skip_sync_nodes(struct bitmap *bitmap, unsigned long *nodes,
+			    sector_t lo, sector_t hi);
 
 void bitmap_unplug(struct bitmap *bitmap);
 void bitmap_daemon_work(struct mddev *mddev, int node);
+void bitmap_free_node(struct bitmap *bitmap, int node);
+void bitmap_kick_locks(struct mddev *mddev);
 
 int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 		  int chunksize, int init);
@@ -504,6 +504,10 @@ static void mddev_put(struct mddev *mddev)
 		bioset_free(bs);
 }
 
+static void md_meta_release(struct work_struct *ws);
+static void md_resize_work(struct work_struct *ws);
+static void md_refresh_work(struct work_struct *ws);
+
 void mddev_init(struct mddev *mddev)
 {
 	mutex_init(&mddev->open_mutex);
@@ -511,7 +515,6 @@ void mddev_init(struct mddev *mddev)
 	mutex_init(&mddev->bitmap_info.mutex);
 	INIT_LIST_HEAD(&mddev->disks);
 	INIT_LIST_HEAD(&mddev->all_mddevs);
-	INIT_LIST_HEAD(&mddev->dlm_md_bitmap);
 	INIT_LIST_HEAD(&mddev->send_list);
 	INIT_LIST_HEAD(&mddev->suspend_range);
 	spin_lock_init(&mddev->send_lock);
@@ -526,8 +529,12 @@ void mddev_init(struct mddev *mddev)
 	init_waitqueue_head(&mddev->bitmap_wait);
 	mutex_init(&mddev->msg_mutex);
 	mutex_init(&mddev->sb_mutex);
+	mddev->meta_mode = DLM_LOCK_IV;
+	INIT_WORK(&mddev->meta_release, md_meta_release);
+	INIT_DELAYED_WORK(&mddev->resize_work, md_resize_work);
+	spin_lock_init(&mddev->refresh_lock);
+	INIT_WORK(&mddev->refresh_work, md_refresh_work);
 	mutex_init(&mddev->avail_mutex);
-	mutex_init(&mddev->reclaim_mutex);
 	mddev->reshape_position = MaxSector;
 	mddev->reshape_backwards = 0;
 	mddev->last_sync_action = "none";
@@ -792,14 +799,37 @@ void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
 	 * if zero is reached.
 	 * If an error occurred, call md_error
 	 */
-	struct bio *bio = bio_alloc_mddev(GFP_NOIO, 1, mddev);
+	md_super_write_pages(mddev, rdev, sector, size, &page, 1);
+}
 
-	bio->bi_bdev = rdev->meta_bdev ? rdev->meta_bdev : rdev->bdev;
-	bio->bi_sector = sector;
-	bio_add_page(bio, page, size, 0);
-	bio->bi_private = rdev;
-	bio->bi_end_io = super_written;
+void md_super_write_pages(struct mddev *mddev, struct md_rdev *rdev,
+			  sector_t sector, int size,
+			  struct page **pages, int nr)
+{
+	/* as md_super_write, for nr pages that are consecutive on disk.
+	 * All but the last are written whole, size is the number of
+	 * bytes to write from the last one. They go out in as few bios
+	 * as the device allows.
+	 */
+	struct bio *bio = NULL;
+	int i, len;
 
+	for (i = 0; i < nr; i++) {
+		len = (i == nr - 1) ? size : PAGE_SIZE;
+		if (bio && bio_add_page(bio, pages[i], len, 0) == len)
+			continue;
+		if (bio) {
+			atomic_inc(&mddev->pending_writes);
+			submit_bio(WRITE_FLUSH_FUA, bio);
+		}
+		bio = bio_alloc_mddev(GFP_NOIO, min(nr - i, BIO_MAX_PAGES),
+				      mddev);
+		bio->bi_bdev = rdev->meta_bdev ? rdev->meta_bdev : rdev->bdev;
+		bio->bi_sector = sector + i * (PAGE_SIZE >> 9);
+		bio->bi_private = rdev;
+		bio->bi_end_io = super_written;
+		bio_add_page(bio, pages[i], len, 0);
+	}
 	atomic_inc(&mddev->pending_writes);
 	submit_bio(WRITE_FLUSH_FUA, bio);
 }
@@ -825,34 +855,59 @@ static void bi_complete(struct bio *bio, int error)
 int sync_page_io(struct md_rdev *rdev, sector_t sector, int size,
 		 struct page *page, int rw, bool metadata_op)
 {
-	struct bio *bio = bio_alloc_mddev(GFP_NOIO, 1, rdev->mddev);
+	return sync_pages_io(rdev, sector, size, &page, 1, rw, metadata_op);
+}
+EXPORT_SYMBOL_GPL(sync_page_io);
+
+int sync_pages_io(struct md_rdev *rdev, sector_t sector, int size,
+		  struct page **pages, int nr, int rw, bool metadata_op)
+{
+	/* as sync_page_io, for nr pages that are consecutive on disk.
+	 * All but the last are transferred whole, size is the number of
+	 * bytes of the last one. Returns 1 if all of it succeeded.
+	 */
 	struct completion event;
-	int ret;
+	struct bio *bio;
+	int i = 0, len, ret = 1;
 
 	rw |= REQ_SYNC;
 
-	bio->bi_bdev = (metadata_op && rdev->meta_bdev) ?
-		rdev->meta_bdev : rdev->bdev;
 	if (metadata_op)
-		bio->bi_sector = sector + rdev->sb_start;
+		sector += rdev->sb_start;
 	else if (rdev->mddev->reshape_position != MaxSector &&
 		 (rdev->mddev->reshape_backwards ==
 		  (sector >= rdev->mddev->reshape_position)))
-		bio->bi_sector = sector + rdev->new_data_offset;
+		sector += rdev->new_data_offset;
 	else
-		bio->bi_sector = sector + rdev->data_offset;
-	bio_add_page(bio, page, size, 0);
-	init_completion(&event);
-	bio->bi_private = &event;
-	bio->bi_end_io = bi_complete;
-	submit_bio(rw, bio);
-	wait_for_completion(&event);
-
-	ret = test_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_put(bio);
+		sector += rdev->data_offset;
+
+	while (ret && i < nr) {
+		bio = bio_alloc_mddev(GFP_NOIO, min(nr - i, BIO_MAX_PAGES),
+				      rdev->mddev);
+		bio->bi_bdev = (metadata_op && rdev->meta_bdev) ?
+			rdev->meta_bdev : rdev->bdev;
+		bio->bi_sector = sector + i * (PAGE_SIZE >> 9);
+		for (; i < nr; i++) {
+			len = (i == nr - 1) ? size : PAGE_SIZE;
+			if (bio_add_page(bio, pages[i], len, 0) != len)
+				break;
+		}
+		if (!bio->bi_vcnt) {
+			bio_put(bio);
+			return 0;
+		}
+		init_completion(&event);
+		bio->bi_private = &event;
+		bio->bi_end_io = bi_complete;
+		submit_bio(rw, bio);
+		wait_for_completion(&event);
+
+		ret = test_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_put(bio);
+	}
 	return ret;
 }
-EXPORT_SYMBOL_GPL(sync_page_io);
+EXPORT_SYMBOL_GPL(sync_pages_io);
 
 static int read_disk_sb(struct md_rdev * rdev, int size)
 {
@@ -2439,14 +2494,78 @@ static void sync_sbs(struct mddev * mddev, int nospares)
 	}
 }
 
+/* the MD_DISK_* bits other nodes need to know about */
+static int md_rdev_state(struct md_rdev *rdev)
+{
+	int state = 0;
+
+	if (test_bit(Faulty, &rdev->flags))
+		state |= (1 << MD_DISK_FAULTY);
+	if (test_bit(In_sync, &rdev->flags))
+		state |= (1 << MD_DISK_SYNC);
+	if (test_bit(WriteMostly, &rdev->flags))
+		state |= (1 << MD_DISK_WRITEMOSTLY);
+	return state;
+}
+
+/*
+ * record what md_update_sb wrote in the metadata lock's lvb, it goes
+ * out when the cached EX is given up.  A new member set or size moves
+ * the generation on, other nodes then read the superblocks instead.
+ */
+static void md_fill_meta_lvb(struct mddev *mddev)
+{
+	struct meta_lvb *lvb;
+	struct md_rdev *rdev;
+	u64 members = 0;
+	int nr = 0;
+
+	if (!mddev->dlm_md_meta)
+		return;
+	lvb = (struct meta_lvb *)mddev->dlm_md_meta->lksb.sb_lvbptr;
+	rdev_for_each(rdev, mddev) {
+		if (rdev->desc_nr < 0 || rdev->desc_nr >= 64 ||
+		    nr == META_LVB_RDEVS) {
+			nr = -1;
+			break;
+		}
+		members |= 1ULL << rdev->desc_nr;
+		lvb->rdevs[nr].desc_nr = cpu_to_le32(rdev->desc_nr);
+		lvb->rdevs[nr].role = cpu_to_le16((u16)rdev->raid_disk);
+		lvb->rdevs[nr].state = cpu_to_le16(md_rdev_state(rdev));
+		lvb->rdevs[nr].recovery_offset =
+			cpu_to_le64(rdev->recovery_offset);
+		nr++;
+	}
+	/* nobody vouches for a lvb whose last writer died */
+	if (nr < 0 || le64_to_cpu(lvb->members) != members ||
+	    (mddev->dlm_md_meta->lksb.sb_flags & DLM_SBF_VALNOTVALID) ||
+	    le32_to_cpu(lvb->raid_disks) != mddev->raid_disks ||
+	    le64_to_cpu(lvb->dev_sectors) != mddev->dev_sectors)
+		le64_add_cpu(&lvb->generation, 1);
+	lvb->events = cpu_to_le64(mddev->events);
+	lvb->recovery_cp = cpu_to_le64(mddev->recovery_cp);
+	lvb->dev_sectors = cpu_to_le64(mddev->dev_sectors);
+	lvb->members = cpu_to_le64(members);
+	lvb->raid_disks = cpu_to_le32(mddev->raid_disks);
+	lvb->nr = cpu_to_le32(nr);
+	/* it is all ours now */
+	mddev->dlm_md_meta->lksb.sb_flags &= ~DLM_SBF_VALNOTVALID;
+	mddev->meta_gen = le64_to_cpu(lvb->generation);
+}
+
 static void md_update_sb(struct mddev * mddev, int force_change)
 {
 	struct md_rdev *rdev;
 	int sync_req;
 	int nospares = 0;
 	int any_badblocks_changed = 0;
+	int change_clean = 0;
+	int locked = 0;
 	int ret = -EAGAIN;
 
+	/* no early return may leave a stale mask for md_send_metadata_update */
+	mddev->sb_written = 0;
 	if (mddev->ro) {
 		if (force_change)
 			set_bit(MD_CHANGE_DEVS, &mddev->flags);
@@ -2488,7 +2607,8 @@ repeat:
 
 	if (test_and_clear_bit(MD_CHANGE_DEVS, &mddev->flags))
 		force_change = 1;
-	if (test_and_clear_bit(MD_CHANGE_CLEAN, &mddev->flags))
+	change_clean = test_and_clear_bit(MD_CHANGE_CLEAN, &mddev->flags);
+	if (change_clean)
 		/* just a clean<-> dirty transition, possibly leave spares alone,
 		 * though if events isn't the right even/odd, we will have to do
 		 * spares after all
@@ -2554,10 +2674,21 @@ repeat:
 
 	bitmap_update_sb(mddev->bitmap);
 
-	ret = md_lock_super(mddev, DLM_LOCK_EX);
-
-	if (ret) {
-		return;
+	/* held across repeats, so changes racing with the write cost no
+	 * extra lock cycle */
+	if (!locked) {
+		ret = md_lock_super(mddev, DLM_LOCK_EX);
+		if (ret) {
+			/* nothing was written, leave it for the next pass */
+			printk(KERN_WARNING "md: %s: superblock lock failed: %d\n",
+			       mdname(mddev), ret);
+			if (force_change)
+				set_bit(MD_CHANGE_DEVS, &mddev->flags);
+			if (change_clean)
+				set_bit(MD_CHANGE_CLEAN, &mddev->flags);
+			return;
+		}
+		locked = 1;
 	}
 
 	rdev_for_each(rdev, mddev) {
@@ -2571,6 +2702,10 @@ repeat:
 			md_super_write(mddev,rdev,
 				       rdev->sb_start, rdev->sb_size,
 				       rdev->sb_page);
+			if (rdev->desc_nr >= 0 && rdev->desc_nr < 64)
+				mddev->sb_written |= 1ULL << rdev->desc_nr;
+			else
+				mddev->sb_written = ~0ULL;
 			pr_debug("md: (write) %s's sb offset: %llu\n",
 				 bdevname(rdev->bdev, b),
 				 (unsigned long long)rdev->sb_start);
@@ -2594,13 +2729,7 @@ repeat:
 			break;
 	}
 	md_super_wait(mddev);
-
-
-	/* CRAID1: metadata updated, broadcast 
-	 * metadata update finished message to other nodes.
-	 */
-	md_unlock_super(mddev);
-
+	md_fill_meta_lvb(mddev);
 
 	/* if there was a failure, MD_CHANGE_DEVS was set, and we re-write super */
 
@@ -2613,6 +2742,8 @@ repeat:
 	}
 	clear_bit(MD_CHANGE_PENDING, &mddev->flags);
 	spin_unlock_irq(&mddev->write_lock);
+	/* the caller broadcasts what was written once, after the loop */
+	md_unlock_super(mddev);
 	wake_up(&mddev->sb_wait);
 	if (test_bit(MD_RECOVERY_RUNNING, &mddev->recovery))
 		sysfs_notify(&mddev->kobj, NULL, "sync_completed");
@@ -2730,8 +2861,9 @@ state_store(struct md_rdev *rdev, const char *buf, size_t len)
 			kick_rdev_from_array(rdev);
 			if (mddev->pers) {
 				md_update_sb(mddev, 1);
-				ret = md_send_metadata_update(mddev, 0);
-				if (!ret) {
+				ret = md_send_metadata_update(mddev,
+							      mddev->sb_written, 0);
+				if (ret) {
 					printk(KERN_WARNING "send metadata update failed!\n");
 				}
 			}
@@ -4180,8 +4312,8 @@ size_store(struct mddev *mddev, const char *buf, size_t len)
 	if (mddev->pers) {
 		err = update_size(mddev, sectors);
 		md_update_sb(mddev, 1);
-		ret = md_send_metadata_update(mddev, 0);
-		if (!ret) {
+		ret = md_send_resize(mddev, 0);
+		if (ret) {
 			printk(KERN_WARNING "send metadata update failed!\n");
 		}
 	} else {
@@ -5231,8 +5363,8 @@ int md_run(struct mddev *mddev)
 		 * later when sen thread is wake up, message 
 		 * will be sent out
 		 */
-		ret = md_send_metadata_update(mddev, 1);
-		if (!ret) {
+		ret = md_send_metadata_update(mddev, mddev->sb_written, 1);
+		if (ret) {
 			printk(KERN_WARNING "send metadata update failed!\n");
 		}
 	}
@@ -5246,15 +5378,65 @@ int md_run(struct mddev *mddev)
 }
 EXPORT_SYMBOL_GPL(md_run);
 
-int md_send_metadata_update(struct mddev *mddev, int async)
+/*
+ * fold an async message into one of the same kind still waiting on
+ * send_list, so a burst of superblock updates goes out as one message.
+ * Called with send_lock held, returns 1 if merged.
+ */
+static int md_merge_cluster_msg(struct mddev *mddev, int type, int nr,
+				u64 low, u64 high)
 {
 	struct dlm_md_msg *msg;
-	struct cluster_msg *update;
-	/* super block updated. 
-	 * Should prepare message to the send thread
-	 * later when sen thread is wake up, message 
-	 * will be sent out
-	 */
+	struct cluster_msg *cmsg;
+
+	list_for_each_entry_reverse(msg, &mddev->send_list, list) {
+		cmsg = (struct cluster_msg *)msg->buf;
+		if (!msg->async || le32_to_cpu(cmsg->type) != type)
+			continue;
+		switch (type) {
+		case METADATA_UPDATED:
+			low = max(low, (u64)le64_to_cpu(cmsg->low));
+			high |= le64_to_cpu(cmsg->high);
+			break;
+		case EVENTS_UPDATED:
+			/* the newer recovery_cp wins */
+			low = max(low, (u64)le64_to_cpu(cmsg->low));
+			break;
+		case RDEV_STATE:
+			if (le32_to_cpu(cmsg->bitmap) != nr)
+				continue;
+			break;
+		case ARRAY_RESIZED:
+			break;
+		default:
+			return 0;
+		}
+		cmsg->low = cpu_to_le64(low);
+		cmsg->high = cpu_to_le64(high);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * queue one cluster_msg for the send thread.  With async set, return
+ * once it is queued, the send thread frees it after every node acked.
+ */
+static int md_send_cluster_msg(struct mddev *mddev, int type, int nr,
+			       u64 low, u64 high, int async)
+{
+	struct dlm_md_msg *msg;
+	struct cluster_msg *cmsg;
+	int ret = 0;
+
+	if (async) {
+		spin_lock(&mddev->send_lock);
+		if (md_merge_cluster_msg(mddev, type, nr, low, high)) {
+			spin_unlock(&mddev->send_lock);
+			return 0;
+		}
+		spin_unlock(&mddev->send_lock);
+	}
 	msg = kzalloc(sizeof(struct dlm_md_msg), GFP_KERNEL);
 	if (!msg) {
 		printk(KERN_WARNING "alloc memory for msg failed!\n");
@@ -5269,25 +5451,87 @@ int md_send_metadata_update(struct mddev *mddev, int async)
 		kfree(msg);
 		return -ENOMEM;
 	}
+	msg->len = sizeof(struct cluster_msg);
 	msg->async = async;
-	update = (struct cluster_msg *)msg->buf;
-	update->type = cpu_to_le32(METADATA_UPDATED);
+	cmsg = (struct cluster_msg *)msg->buf;
+	cmsg->type = cpu_to_le32(type);
+	cmsg->bitmap = cpu_to_le32(nr);
+	cmsg->low = cpu_to_le64(low);
+	cmsg->high = cpu_to_le64(high);
 	spin_lock(&mddev->send_lock);
 	list_add_tail(&msg->list, &mddev->send_list);
 	spin_unlock(&mddev->send_lock);
 	md_wakeup_thread(mddev->send_thread);
 	if (!async) {
 		wait_event(msg->waiter, msg->sent != 0);
+		ret = msg->sent < 0 ? msg->sent : 0;
 		kfree(msg->buf);
 		kfree(msg);
 	}
-	return 0;
+	return ret;
+}
+
+/*
+ * full update: receivers re-read the superblocks in changed, a desc_nr
+ * mask (normally the sb_written of the md_update_sb just done).  Only
+ * needed when the set of members or the array geometry changed,
+ * otherwise send the deltas with md_send_sb_delta().
+ */
+int md_send_metadata_update(struct mddev *mddev, u64 changed, int async)
+{
+	return md_send_cluster_msg(mddev, METADATA_UPDATED, 0, mddev->events,
+				   changed, async);
+}
+
+static int md_send_rdev_state(struct mddev *mddev, struct md_rdev *rdev,
+			      int async)
+{
+	u64 state = md_rdev_state(rdev);
+
+	state |= (u64)(u32)rdev->raid_disk << 32;
+	return md_send_cluster_msg(mddev, RDEV_STATE, rdev->desc_nr,
+				   state, rdev->recovery_offset, async);
+}
+
+/*
+ * broadcast what md_update_sb just wrote: the state of every member
+ * when devs is set (MD_CHANGE_DEVS was pending), then the new event
+ * count.  The messages go out in order, so waiting for the last one
+ * is enough.
+ */
+int md_send_sb_delta(struct mddev *mddev, int devs, int async)
+{
+	struct md_rdev *rdev;
+	int ret;
+
+	if (devs)
+		rdev_for_each(rdev, mddev) {
+			if (rdev->desc_nr < 0)
+				continue;
+			ret = md_send_rdev_state(mddev, rdev, 1);
+			if (ret)
+				return ret;
+		}
+	return md_send_cluster_msg(mddev, EVENTS_UPDATED, 0,
+				   mddev->events, mddev->recovery_cp, async);
+}
+
+int md_send_resize(struct mddev *mddev, int async)
+{
+	int ret;
+
+	ret = md_send_cluster_msg(mddev, ARRAY_RESIZED, 0,
+				  mddev->dev_sectors, 0, 1);
+	if (ret)
+		return ret;
+	return md_send_sb_delta(mddev, 0, async);
 }
 
 int md_send_resync_finished(struct mddev *mddev, int bmpno)
 {
 	struct dlm_md_msg *msg;
 	struct cluster_msg *resync;
+	int ret = 0;
 	msg = kzalloc(sizeof(struct dlm_md_msg), GFP_KERNEL);
 	if (!msg) {
 		printk(KERN_WARNING "allocate memory for message failed!\n");
@@ -5310,15 +5554,24 @@ int md_send_resync_finished(struct mddev *mddev, int bmpno)
 	spin_unlock(&mddev->send_lock);
 	md_wakeup_thread(mddev->send_thread);
 	wait_event(msg->waiter, msg->sent != 0);
+	ret = msg->sent < 0 ? msg->sent : 0;
 	kfree(msg->buf);
 	kfree(msg);
-	return 0;
+	return ret;
 }
+EXPORT_SYMBOL(md_send_resync_finished);
 
-int md_send_suspend(struct mddev *mddev, sector_t sus_start, sector_t sus_end)
+/*
+ * announce that bitmap bmpno is resyncing sus_start - sus_end.
+ * With async set, return as soon as the message is queued, the
+ * send thread frees it once every node has acked.
+ */
+int md_send_suspend(struct mddev *mddev, int bmpno, sector_t sus_start,
+		sector_t sus_end, int async)
 {
 	struct dlm_md_msg *msg;
 	struct cluster_msg *suspend;
+	int ret = 0;
 	msg = kzalloc(sizeof(struct dlm_md_msg), GFP_KERNEL);
 	if (!msg) {
 		return -ENOMEM;
@@ -5331,9 +5584,11 @@ int md_send_suspend(struct mddev *mddev, sector_t sus_start, sector_t sus_end)
 
 	suspend = (struct cluster_msg*)msg->buf;
 	suspend->type = cpu_to_le32(SUSPEND_RANGE);
+	suspend->bitmap = cpu_to_le32(bmpno);
 	suspend->low = cpu_to_le64(sus_start);
 	suspend->high = cpu_to_le64(sus_end);
 	msg->len = sizeof(struct cluster_msg);
+	msg->async = async;
 	INIT_LIST_HEAD(&msg->list);
 	init_waitqueue_head(&msg->waiter);
 	msg->sent = 0;
@@ -5341,10 +5596,13 @@ int md_send_suspend(struct mddev *mddev, sector_t sus_start, sector_t sus_end)
 	list_add_tail(&msg->list, &mddev->send_list);
 	spin_unlock(&mddev->send_lock);
 	md_wakeup_thread(mddev->send_thread);
-	wait_event(msg->waiter, msg->sent != 0);
-	kfree(msg->buf);
-	kfree(msg);
-	return 0;
+	if (!async) {
+		wait_event(msg->waiter, msg->sent != 0);
+		ret = msg->sent < 0 ? msg->sent : 0;
+		kfree(msg->buf);
+		kfree(msg);
+	}
+	return ret;
 }
 EXPORT_SYMBOL(md_send_suspend);
 
@@ -5492,8 +5750,8 @@ static void __md_stop_writes(struct mddev *mddev)
 		/* mark array as shutdown cleanly */
 		mddev->in_sync = 1;
 		md_update_sb(mddev, 1);
-		ret = md_send_metadata_update(mddev, 0);
-		if (!ret) {
+		ret = md_send_sb_delta(mddev, 0, 0);
+		if (ret) {
 			printk(KERN_WARNING "send metadata update failed!\n");
 		}
 	}
@@ -6095,7 +6353,8 @@ static int add_new_disk(struct mddev * mddev, mdu_disk_info_t *info)
 		md_wakeup_thread(mddev->thread);
 		//if we send message in md_update_sb() later, then don't need to 
 		//send the metadata_update message here
-		md_send_metadata_update(mddev, 0);
+		/* nothing was written for it yet, have them read all */
+		md_send_metadata_update(mddev, ~0ULL, 0);
 		return err;
 	}
 
@@ -6165,8 +6424,8 @@ static int hot_remove_disk(struct mddev * mddev, dev_t dev)
 
 	kick_rdev_from_array(rdev);
 	md_update_sb(mddev, 1);
-	ret = md_send_metadata_update(mddev, 0);
-	if (!ret) {
+	ret = md_send_metadata_update(mddev, mddev->sb_written, 0);
+	if (ret) {
 		printk(KERN_WARNING "send metadata update failed!\n");
 	}
 	md_new_event(mddev);
@@ -6238,8 +6497,8 @@ static int hot_add_disk(struct mddev * mddev, dev_t dev)
 	rdev->raid_disk = -1;
 
 	md_update_sb(mddev, 1);
-	ret = md_send_metadata_update(mddev, 0);
-	if (!ret) {
+	ret = md_send_metadata_update(mddev, mddev->sb_written, 0);
+	if (ret) {
 		printk(KERN_WARNING "send metadata update failed!\n");
 	}
 
@@ -6585,8 +6844,8 @@ static int update_array_info(struct mddev *mddev, mdu_array_info_t *info)
 		}
 	}
 	md_update_sb(mddev, 1);
-	ret = md_send_metadata_update(mddev, 0);
-	if (!ret) {
+	ret = md_send_metadata_update(mddev, mddev->sb_written, 0);
+	if (ret) {
 		printk(KERN_WARNING "send metadata update failed!\n");
 	}
 	return rv;
@@ -7618,8 +7877,8 @@ int md_allow_write(struct mddev *mddev)
 			mddev->safemode = 1;
 		spin_unlock_irq(&mddev->write_lock);
 		md_update_sb(mddev, 0);
-		ret = md_send_metadata_update(mddev, 1);
-		if (!ret) {
+		ret = md_send_sb_delta(mddev, 0, 1);
+		if (ret) {
 			printk(KERN_WARNING "send metadata update failed!\n");
 		}
 		sysfs_notify_dirent_safe(mddev->sysfs_state);
@@ -7633,6 +7892,189 @@ int md_allow_write(struct mddev *mddev)
 }
 EXPORT_SYMBOL_GPL(md_allow_write);
 
+/*
+ * Region size for splitting a bitmap resync between nodes. It is a
+ * whole number of on-disk bitmap pages, so two nodes never clear bits
+ * in the same page of a failed node's bitmap.
+ */
+static sector_t md_region_sectors(struct mddev *mddev, sector_t max_sectors)
+{
+	sector_t span = (sector_t)(PAGE_SIZE << 3) <<
+		mddev->bitmap->counts.chunkshift;
+	sector_t len = max_sectors + MD_RESYNC_REGIONS - 1;
+
+	sector_div(len, MD_RESYNC_REGIONS);
+	return (len + span - 1) & ~(span - 1);
+}
+
+/*
+ * The region lvb is a bitmap of node slots kept as little-endian 64-bit
+ * words, so that it reads the same on every node.
+ */
+static int md_region_test(__le64 *lvb, int node)
+{
+	return (le64_to_cpu(lvb[node / 64]) >> (node % 64)) & 1;
+}
+
+static void md_region_set(__le64 *lvb, int node)
+{
+	lvb[node / 64] |= cpu_to_le64(1ULL << (node % 64));
+}
+
+static void md_region_clear(__le64 *lvb, int node)
+{
+	lvb[node / 64] &= ~cpu_to_le64(1ULL << (node % 64));
+}
+
+static int md_region_lock(struct mddev *mddev, int r, uint32_t flags)
+{
+	struct dlm_lock_resource *res = mddev->dlm_md_region[r];
+
+	res->mode = DLM_LOCK_EX;
+	res->flags = DLM_LKF_CONVERT | DLM_LKF_VALBLK | flags;
+	return dlm_lock_sync(mddev->dlm_md_lockspace, res);
+}
+
+/* drop back to NL, recording that the region is in sync if done */
+static void md_region_unlock(struct mddev *mddev, int r, int done)
+{
+	struct dlm_lock_resource *res = mddev->dlm_md_region[r];
+	__le64 *lvb = (__le64 *)res->lksb.sb_lvbptr;
+	int i;
+
+	if (done)
+		for_each_set_bit(i, mddev->avail_bitmap,
+				 mddev->bitmap_info.nodes)
+			md_region_set(lvb, i);
+	res->mode = DLM_LOCK_NL;
+	res->flags = DLM_LKF_CONVERT | DLM_LKF_VALBLK;
+	if (dlm_lock_sync(mddev->dlm_md_lockspace, res))
+		printk(KERN_ERR "md: %s: failed to release %s\n",
+		       mdname(mddev), res->name);
+}
+
+/*
+ * Whether region r has been resynced for every bitmap we recover.
+ * An invalid lvb means a node died holding the region, so it counts
+ * as not done for anyone.
+ */
+static int md_region_done(struct mddev *mddev, int r)
+{
+	struct dlm_lock_resource *res = mddev->dlm_md_region[r];
+	__le64 *lvb = (__le64 *)res->lksb.sb_lvbptr;
+	int i;
+
+	if (res->lksb.sb_flags & DLM_SBF_VALNOTVALID) {
+		memset(lvb, 0, MSG_LVB_SIZE);
+		return 0;
+	}
+	for_each_set_bit(i, mddev->avail_bitmap, mddev->bitmap_info.nodes)
+		if (!md_region_test(lvb, i))
+			return 0;
+	return 1;
+}
+
+/*
+ * Another node resynced region r: drop our own NEEDED bits for it,
+ * or every later resync would do it again.
+ */
+static void md_region_skip(struct mddev *mddev, int r, sector_t max_sectors,
+			   sector_t region_sectors)
+{
+	sector_t lo = (sector_t)r * region_sectors;
+
+	bitmap_skip_sync_nodes(mddev->bitmap, mddev->avail_bitmap, lo,
+			       min(lo + region_sectors, max_sectors));
+}
+
+/*
+ * Find the next region from j on that this node should resync and
+ * lock it. Regions another node is busy with are noted in busy and
+ * skipped, as are regions somebody has already finished.
+ * Returns where to carry on, max_sectors if nothing is left.
+ */
+static sector_t md_next_region(struct mddev *mddev, sector_t j,
+			       sector_t max_sectors, sector_t region_sectors,
+			       int *region, unsigned long *busy)
+{
+	int r, ret;
+
+	for (r = 0; (sector_t)(r + 1) * region_sectors <= j; r++)
+		;
+	for (; r < MD_RESYNC_REGIONS && j < max_sectors; r++) {
+		if (j < (sector_t)r * region_sectors)
+			j = (sector_t)r * region_sectors;
+		ret = md_region_lock(mddev, r, DLM_LKF_NOQUEUE);
+		if (ret) {
+			if (ret != -EAGAIN)
+				printk(KERN_ERR "md: %s: failed to lock resync region %d\n",
+				       mdname(mddev), r);
+			set_bit(r, busy);
+			continue;
+		}
+		if (md_region_done(mddev, r)) {
+			md_region_unlock(mddev, r, 0);
+			md_region_skip(mddev, r, max_sectors, region_sectors);
+			continue;
+		}
+		*region = r;
+		return j;
+	}
+	*region = -1;
+	return max_sectors;
+}
+
+/*
+ * Wait for the regions other nodes were resyncing. Returns non-zero
+ * if one of them was left unfinished, its node must have died and
+ * the resync has to run again.
+ */
+static int md_wait_regions(struct mddev *mddev, unsigned long *busy,
+			   sector_t max_sectors, sector_t region_sectors)
+{
+	int r, done, unfinished = 0;
+
+	for_each_set_bit(r, busy, MD_RESYNC_REGIONS) {
+		if (md_region_lock(mddev, r, 0)) {
+			unfinished = 1;
+			continue;
+		}
+		done = md_region_done(mddev, r);
+		md_region_unlock(mddev, r, 0);
+		if (done)
+			md_region_skip(mddev, r, max_sectors, region_sectors);
+		else
+			unfinished = 1;
+	}
+	return unfinished;
+}
+
+/*
+ * Once a bitmap has been recovered everywhere, forget it in the
+ * region lvbs so that its next failure is resynced again. A node
+ * still scanning may redo some regions, which is harmless.
+ */
+static void md_clear_regions(struct mddev *mddev)
+{
+	struct dlm_lock_resource *res;
+	__le64 *lvb;
+	int r, i;
+
+	for (r = 0; r < MD_RESYNC_REGIONS; r++) {
+		if (md_region_lock(mddev, r, 0))
+			continue;
+		res = mddev->dlm_md_region[r];
+		lvb = (__le64 *)res->lksb.sb_lvbptr;
+		if (res->lksb.sb_flags & DLM_SBF_VALNOTVALID)
+			memset(lvb, 0, MSG_LVB_SIZE);
+		else
+			for_each_set_bit(i, mddev->avail_bitmap,
+					 mddev->bitmap_info.nodes)
+				md_region_clear(lvb, i);
+		md_region_unlock(mddev, r, 0);
+	}
+}
+
 #define SYNC_MARKS	10
 #define	SYNC_MARK_STEP	(3*HZ)
 #define UPDATE_FREQUENCY (5*60*HZ)
@@ -7653,9 +8095,11 @@ void md_do_sync(struct md_thread *thread)
 	struct md_rdev *rdev;
 	char *desc, *action = NULL;
 	struct blk_plug plug;
-	int ret = -EAGAIN, i, ii;
-	struct dlm_lock_resource *res;
-	struct bitmap *bmp = mddev->bitmap;
+	int ret = -EAGAIN, i;
+	/* splitting a bitmap resync with the other nodes */
+	sector_t region_sectors = 0, region_end = 0;
+	int region = -1, unfinished = 0, use_regions;
+	DECLARE_BITMAP(busy, MD_RESYNC_REGIONS);
 
 	/* just incase thread restarts... */
 	if (test_bit(MD_RECOVERY_DONE, &mddev->recovery))
@@ -7694,39 +8138,23 @@ void md_do_sync(struct md_thread *thread)
 	 * This will mean we have to start checking from the beginning again.
 	 *
 	 */
-	/* obtain EX on dlm_md_resync to make sure
-	 * only one node can do resync at the same time
-	 * also get PW lock on the avail_bitmaps 
+	/* A bitmap resync is shared: every node doing one holds PR on
+	 * dlm_md_resync and the work is split by region locks. Anything
+	 * else takes EX and runs alone. The bitmaps being recovered stay
+	 * at CR, which keeps their owner from coming back: the lock work
+	 * does not hand them back while we hold avail_mutex.
 	 */
+	use_regions = mddev->bitmap && mddev->dlm_md_region[0] &&
+		test_bit(MD_RECOVERY_SYNC, &mddev->recovery) &&
+		!test_bit(MD_RECOVERY_REQUESTED, &mddev->recovery);
+	bitmap_zero(busy, MD_RESYNC_REGIONS);
 	mddev->dlm_md_resync->finished = 0;
-	mddev->dlm_md_resync->mode = DLM_LOCK_EX;
+	mddev->dlm_md_resync->mode = use_regions ? DLM_LOCK_PR : DLM_LOCK_EX;
 	memset(&mddev->dlm_md_resync->lksb, 0, sizeof(struct dlm_lksb));
 	ret = dlm_lock_sync(mddev->dlm_md_lockspace, mddev->dlm_md_resync);
-	if (!ret) {
+	if (ret)
 		return;
-	}
 	mutex_lock(&mddev->avail_mutex);
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->avail_bitmap[i] == -1) {
-			continue;
-		}
-		res = find_bitmap_by_node(mddev, mddev->avail_bitmap[i]);
-		res->mode = DLM_LOCK_PW;
-		res->finished = 0;
-		res->flags = DLM_LKF_CONVERT;
-		ret = bitmap_lock_sync(res);
-		if (!ret) {
-			ii = i - 1;
-			while (ii >= 0) {
-				res = find_bitmap_by_node(mddev, mddev->avail_bitmap[ii]);
-				bitmap_unlock_sync(res);
-				ii--;
-			}
-			dlm_unlock_sync(mddev->dlm_md_lockspace, mddev->dlm_md_resync);
-			return;
-		}
-	}
-		 
 
 	do {
 		mddev->curr_resync = 2;
@@ -7830,6 +8258,9 @@ void md_do_sync(struct md_thread *thread)
 	window = 32*(PAGE_SIZE/512);
 	printk(KERN_INFO "md: using %dk window, over a total of %lluk.\n",
 		window/2, (unsigned long long)max_sectors/2);
+	if (use_regions)
+		region_sectors = md_region_sectors(mddev, max_sectors);
+	mddev->region_start = 0;
 
 	atomic_set(&mddev->recovery_active, 0);
 	last_check = 0;
@@ -7886,6 +8317,24 @@ void md_do_sync(struct md_thread *thread)
 		if (kthread_should_stop())
 			goto interrupted;
 
+		if (region_sectors && j >= region_end) {
+			if (region >= 0) {
+				wait_event(mddev->recovery_wait,
+					   atomic_read(&mddev->recovery_active) == 0);
+				md_region_unlock(mddev, region, 1);
+			}
+			j = md_next_region(mddev, j, max_sectors,
+					   region_sectors, &region, busy);
+			if (region < 0) {
+				mddev->curr_resync = j;
+				break;
+			}
+			region_end = min((sector_t)(region + 1) * region_sectors,
+					 max_sectors);
+			/* the suspend window restarts here */
+			mddev->region_start = j;
+		}
+
 		sectors = mddev->pers->sync_request(mddev, j, &skipped,
 						  currspeed < speed_min(mddev));
 		if (sectors == 0) {
@@ -7953,14 +8402,31 @@ void md_do_sync(struct md_thread *thread)
 			}
 		}
 	}
+	if (region_sectors && !test_bit(MD_RECOVERY_INTR, &mddev->recovery)) {
+		if (region >= 0) {
+			wait_event(mddev->recovery_wait,
+				   atomic_read(&mddev->recovery_active) == 0);
+			md_region_unlock(mddev, region, 1);
+			region = -1;
+		}
+		unfinished = md_wait_regions(mddev, busy, max_sectors,
+					     region_sectors);
+		if (unfinished) {
+			/* run again, the finished regions are skipped */
+			printk(KERN_INFO "md: %s: %s left unfinished by a failed node, restarting.\n",
+			       mdname(mddev), desc);
+			set_bit(MD_RECOVERY_INTR, &mddev->recovery);
+			set_bit(MD_RECOVERY_NEEDED, &mddev->recovery);
+			goto out;
+		}
+	}
 	printk(KERN_INFO "md: %s: %s done.\n",mdname(mddev), desc);
 	/* resync finished. broadcast out resync -N finished message. */
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->avail_bitmap[i] == -1) {
-			continue;
-		}
-		md_send_resync_finished(mddev, mddev->avail_bitmap[i]);
+	for_each_set_bit(i, mddev->avail_bitmap, mddev->bitmap_info.nodes) {
+		md_send_resync_finished(mddev, i);
 	}
+	if (region_sectors && !test_bit(MD_RECOVERY_INTR, &mddev->recovery))
+		md_clear_regions(mddev);
 	/* may need to send out suspend message
 	 * with 0 - 0 range? 
 	 */
@@ -7971,6 +8437,8 @@ void md_do_sync(struct md_thread *thread)
  out:
 	blk_finish_plug(&plug);
 	wait_event(mddev->recovery_wait, !atomic_read(&mddev->recovery_active));
+	if (region >= 0)
+		md_region_unlock(mddev, region, 0);
 
 	/* tell personality that we are finished */
 	mddev->pers->sync_request(mddev, max_sectors, &skipped, 1);
@@ -8008,37 +8476,10 @@ void md_do_sync(struct md_thread *thread)
 		}
 	}
  skip:
- 	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->avail_bitmap[i] == -1) {
-			continue;
-		}
-		res = find_bitmap_by_node(mddev, mddev->avail_bitmap[i]);
-		res->mode = DLM_LOCK_CR;
-		res->finished = 0;
-		res->flags = DLM_LKF_CONVERT;
-		ret = bitmap_lock_sync(res);
-	}
 	dlm_unlock_sync(mddev->dlm_md_lockspace, mddev->dlm_md_resync);
-	/* choose one bitmap for our usage. */
-	if (bmp->used == -1) {
-		for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-			if (mddev->avail_bitmap[1] == -1) {
-				continue;
-			}
-			res = find_bitmap_by_node(mddev, mddev->avail_bitmap[i]);
-			res->mode = DLM_LOCK_EX;
-			res->finished = 0;
-			res->flags = DLM_LKF_CONVERT | DLM_LKF_NOQUEUE;
-			ret = bitmap_lock_sync(res);
-			if (!ret) {
-				wake_up(&mddev->bitmap_wait);
-				/* exclude this from avail bitmaps? */
-				mddev->avail_bitmap[i] = -1;
-				break;
-			}
-		}
-	}
 	mutex_unlock(&mddev->avail_mutex);
+	/* the lock work may have been kept off the avail set meanwhile */
+	bitmap_kick_locks(mddev);
 	set_bit(MD_CHANGE_DEVS, &mddev->flags);
 
 	if (!test_bit(MD_RECOVERY_INTR, &mddev->recovery)) {
@@ -8144,6 +8585,45 @@ no_add:
  *  5/ If array is degraded, try to add spares devices
  *  6/ If array has spares or is not in-sync, start a resync thread.
  */
+/*
+ * apply what other nodes reported through RDEV_STATE.
+ * Called with reconfig_mutex held.
+ */
+static void md_apply_remote(struct mddev *mddev)
+{
+	struct md_rdev *rdev;
+	int state;
+
+	rdev_for_each(rdev, mddev) {
+		if (!test_and_clear_bit(RemoteState, &rdev->flags))
+			continue;
+		smp_rmb();
+		state = rdev->remote_state;
+		if (state & (1 << MD_DISK_FAULTY)) {
+			if (!test_bit(Faulty, &rdev->flags))
+				md_error(mddev, rdev);
+			continue;
+		}
+		if (test_bit(Faulty, &rdev->flags))
+			continue;
+		if (state & (1 << MD_DISK_WRITEMOSTLY))
+			set_bit(WriteMostly, &rdev->flags);
+		else
+			clear_bit(WriteMostly, &rdev->flags);
+		if (state & (1 << MD_DISK_SYNC)) {
+			if (!test_bit(In_sync, &rdev->flags) &&
+			    mddev->pers->spare_active) {
+				rdev->recovery_offset = MaxSector;
+				if (mddev->pers->spare_active(mddev))
+					sysfs_notify(&mddev->kobj, NULL,
+						     "degraded");
+			}
+		} else if (!test_bit(In_sync, &rdev->flags))
+			rdev->recovery_offset = rdev->remote_offset;
+		sysfs_notify_dirent_safe(rdev->sysfs_state);
+	}
+}
+
 void md_check_recovery(struct mddev *mddev)
 {
 	int ret;
@@ -8178,6 +8658,8 @@ void md_check_recovery(struct mddev *mddev)
 	if (mddev_trylock(mddev)) {
 		int spares = 0;
 
+		md_apply_remote(mddev);
+
 		if (mddev->ro) {
 			/* On a read-only array we can:
 			 * - remove failed devices
@@ -8211,11 +8693,12 @@ void md_check_recovery(struct mddev *mddev)
 		}
 
 		if (mddev->flags & MD_UPDATE_SB_FLAGS) {
+			int devs = test_bit(MD_CHANGE_DEVS, &mddev->flags);
+
 			md_update_sb(mddev, 0);
-			/* broadcast out METADATA UPDATED
-			 * message here. */
-			ret = md_send_metadata_update(mddev, 1);
-			if (!ret) {
+			/* tell the other nodes what changed */
+			ret = md_send_sb_delta(mddev, devs, 1);
+			if (ret) {
 				printk(KERN_WARNING "send metadata update failed!\n");
 			}
 		}
@@ -8343,8 +8826,8 @@ void md_reap_sync_thread(struct mddev *mddev)
 			rdev->saved_raid_disk = -1;
 
 	md_update_sb(mddev, 1);
-	ret = md_send_metadata_update(mddev, 1);
-	if (!ret) {
+	ret = md_send_sb_delta(mddev, 1, 1);
+	if (ret) {
 		printk(KERN_WARNING "send metadata update failed!\n");
 	}
 	clear_bit(MD_RECOVERY_RUNNING, &mddev->recovery);
@@ -9003,6 +9486,52 @@ int dlm_unlock_sync(dlm_lockspace_t *ls, struct dlm_lock_resource *res)
 }
 EXPORT_SYMBOL(dlm_unlock_sync);
 
+/*
+ * called with sb_mutex held.  Converting down to NL rather than
+ * unlocking publishes the lvb written under EX, and keeps it from
+ * being lost when the last holder goes.
+ */
+static void md_release_meta(struct mddev *mddev)
+{
+	struct dlm_lock_resource *res = mddev->dlm_md_meta;
+
+	if (mddev->meta_mode > DLM_LOCK_NL) {
+		res->mode = DLM_LOCK_NL;
+		res->flags = DLM_LKF_CONVERT | DLM_LKF_VALBLK;
+		if (dlm_lock_sync(mddev->dlm_md_lockspace, res))
+			printk(KERN_WARNING "md: %s: failed to release metadata lock\n",
+			       mdname(mddev));
+		else
+			mddev->meta_mode = DLM_LOCK_NL;
+	}
+	mddev->meta_contended = 0;
+}
+
+static void md_meta_release(struct work_struct *ws)
+{
+	struct mddev *mddev = container_of(ws, struct mddev, meta_release);
+
+	mutex_lock(&mddev->sb_mutex);
+	if (mddev->meta_contended)
+		md_release_meta(mddev);
+	mutex_unlock(&mddev->sb_mutex);
+}
+
+/* another node wants the metadata lock: give it up once we are done */
+static void md_meta_bast(void *arg, int mode)
+{
+	struct dlm_lock_resource *res = arg;
+	struct mddev *mddev = res->mddev;
+
+	mddev->meta_contended = 1;
+	queue_work(md_misc_wq, &mddev->meta_release);
+}
+
+/*
+ * the metadata lock is cached: if it is still granted in a mode at
+ * least as strong as mode, no dlm request is made at all, otherwise
+ * it is dropped to NL and converted up, which also brings in the lvb.
+ */
 int md_lock_super(struct mddev *mddev, int mode)
 {
 	struct mutex *sb_mutex = &mddev->sb_mutex;
@@ -9011,45 +9540,284 @@ int md_lock_super(struct mddev *mddev, int mode)
 	int ret = -EAGAIN;
 
 	mutex_lock(sb_mutex);
+	if (mddev->meta_mode > DLM_LOCK_NL && mddev->meta_mode >= mode)
+		return 0;
+	/* two nodes converting up from a shared mode deadlock each
+	 * other, so go through NL, which blocks nobody */
+	if (mddev->meta_mode > DLM_LOCK_NL) {
+		md_release_meta(mddev);
+		if (mddev->meta_mode > DLM_LOCK_NL) {
+			mutex_unlock(sb_mutex);
+			return -EIO;
+		}
+	}
 	mddev_sb_lock->state = 0;
 	mddev_sb_lock->finished = 0;
 	mddev_sb_lock->mode = mode;
-	mddev_sb_lock->flags = 0;
 	mddev_sb_lock->parent_lkid = 0;
-	memset(&mddev_sb_lock->lksb, 0, sizeof(struct dlm_lksb));
+	mddev_sb_lock->bast = md_meta_bast;
+	mddev_sb_lock->flags = DLM_LKF_VALBLK;
+	if (mddev->meta_mode == DLM_LOCK_IV) {
+		char *lvb = mddev_sb_lock->lksb.sb_lvbptr;
+
+		memset(&mddev_sb_lock->lksb, 0, sizeof(struct dlm_lksb));
+		mddev_sb_lock->lksb.sb_lvbptr = lvb;
+	} else
+		mddev_sb_lock->flags |= DLM_LKF_CONVERT;
 	while (ret && ret == -EAGAIN) {
 		ret = dlm_lock_sync(md_lockspace, mddev_sb_lock);
 	}
 	if (ret) {
 		printk(KERN_WARNING "dlm lock error");
 		mutex_unlock(sb_mutex);
+		return ret;
 	}
-	return ret;
+	mddev->meta_mode = mode;
+	return 0;
 }
 
 void md_unlock_super(struct mddev *mddev)
 {
-	struct mutex *sb_mutex = &mddev->sb_mutex;
-	struct dlm_lock_resource *mddev_sb_lock = mddev->dlm_md_meta;
-	dlm_lockspace_t *md_lockspace = mddev->dlm_md_lockspace;
+	if (mddev->meta_contended)
+		md_release_meta(mddev);
+	mutex_unlock(&mddev->sb_mutex);
+}
 
-	dlm_unlock_sync(md_lockspace, mddev_sb_lock);
-	mutex_unlock(sb_mutex);
+/* give the cached metadata lock back, before dlm_md_meta is freed */
+void md_drop_super(struct mddev *mddev)
+{
+	cancel_work_sync(&mddev->refresh_work);
+	cancel_work_sync(&mddev->meta_release);
+	mutex_lock(&mddev->sb_mutex);
+	md_release_meta(mddev);
+	if (mddev->meta_mode != DLM_LOCK_IV)
+		dlm_unlock_sync(mddev->dlm_md_lockspace, mddev->dlm_md_meta);
+	mddev->meta_mode = DLM_LOCK_IV;
+	mutex_unlock(&mddev->sb_mutex);
 }
+EXPORT_SYMBOL(md_drop_super);
 
-void md_reload_superblock(struct mddev *mddev)
+static void super_read(struct bio *bio, int error)
+{
+	struct md_rdev *rdev = bio->bi_private;
+	struct mddev *mddev = rdev->mddev;
+
+	/* on error leave it to read_disk_sb to retry and complain */
+	if (!error && test_bit(BIO_UPTODATE, &bio->bi_flags)) {
+		rdev->sb_loaded = 1;
+		/* what is on disk now, see sync_sbs */
+		if (mddev->major_version == 0)
+			rdev->sb_events = md_event(page_address(rdev->sb_page));
+		else
+			rdev->sb_events = le64_to_cpu(((struct mdp_superblock_1 *)
+					page_address(rdev->sb_page))->events);
+	}
+	if (atomic_dec_and_test(&mddev->pending_reads))
+		wake_up(&mddev->sb_wait);
+	bio_put(bio);
+}
+
+/*
+ * another node rewrote the superblocks in changed (a desc_nr mask, ~0
+ * for all).  Read just those, all at once, then
+ * let analyze_sbs parse the lot: the others are re-parsed from memory
+ * without any I/O.  Every node moves the event count on by itself, so
+ * an equal count does not mean an equal superblock.
+ */
+void md_reload_superblock(struct mddev *mddev, u64 changed)
 {
 	struct md_rdev *rdev, *tmp;
+	struct bio *bio;
 
 	rdev_for_each_safe(rdev, tmp, mddev) {
+		if (changed != ~0ULL &&
+		    (rdev->desc_nr < 0 || rdev->desc_nr >= 64 ||
+		     !(changed & (1ULL << rdev->desc_nr))))
+			continue;
 		rdev->sb_loaded = 0;
-	}
+		rdev->sb_events = 0;
+		bio = bio_alloc_mddev(GFP_NOIO, 1, mddev);
+		bio->bi_bdev = rdev->meta_bdev ? rdev->meta_bdev : rdev->bdev;
+		bio->bi_sector = rdev->sb_start;
+		bio_add_page(bio, rdev->sb_page, 4096, 0);
+		bio->bi_private = rdev;
+		bio->bi_end_io = super_read;
+		atomic_inc(&mddev->pending_reads);
+		submit_bio(READ_SYNC, bio);
+	}
+	wait_event(mddev->sb_wait, atomic_read(&mddev->pending_reads) == 0);
 	mddev->raid_disks = 0;
 	analyze_sbs(mddev);
 }
-
 EXPORT_SYMBOL(md_reload_superblock);
 
+/* a running recovery owns recovery_cp, leave it alone then */
+void md_apply_events(struct mddev *mddev, u64 events, sector_t recovery_cp)
+{
+	if (events > mddev->events)
+		mddev->events = events;
+	if (!test_bit(MD_RECOVERY_RUNNING, &mddev->recovery))
+		mddev->recovery_cp = recovery_cp;
+}
+EXPORT_SYMBOL(md_apply_events);
+
+/*
+ * record an RDEV_STATE delta for md_check_recovery to apply under
+ * reconfig_mutex, the message handler runs in raid1d without it.
+ * -ENOENT means this node does not know the rdev in that role, the
+ * caller falls back to a full re-read.
+ */
+int md_apply_rdev_state(struct mddev *mddev, int nr, int role, int state,
+			sector_t offset)
+{
+	struct md_rdev *rdev = find_rdev_nr(mddev, nr);
+
+	if (!rdev || rdev->raid_disk != role)
+		return -ENOENT;
+	if (!(state & (1 << MD_DISK_FAULTY)) &&
+	    (test_bit(Faulty, &rdev->flags) ||
+	     (!(state & (1 << MD_DISK_SYNC)) &&
+	      test_bit(In_sync, &rdev->flags))))
+		return -ENOENT;
+	rdev->remote_state = state;
+	rdev->remote_offset = offset;
+	smp_wmb();
+	set_bit(RemoteState, &rdev->flags);
+	set_bit(MD_RECOVERY_NEEDED, &mddev->recovery);
+	md_wakeup_thread(mddev->thread);
+	return 0;
+}
+EXPORT_SYMBOL(md_apply_rdev_state);
+
+/*
+ * Resize as the sending node did, bitmap included, so every node agrees
+ * on where each node's bitmap region lies.  The bitmap resize quiesces
+ * the array, which raid1d cannot do, so this runs from md_misc_wq.
+ */
+static void md_resize_work(struct work_struct *ws)
+{
+	struct mddev *mddev = container_of(to_delayed_work(ws), struct mddev,
+					   resize_work);
+	sector_t sectors;
+	int ret;
+
+	/* stop() holds reconfig_mutex while it cancels us, don't wait */
+	if (!mddev_trylock(mddev))
+		goto retry;
+	if (mddev->sync_thread) {
+		/* as update_size(), not while a resync runs */
+		mddev_unlock(mddev);
+		goto retry;
+	}
+	sectors = mddev->remote_sectors;
+	mddev->remote_sectors = 0;
+	if (mddev->pers && mddev->pers->resize && sectors &&
+	    sectors != mddev->dev_sectors) {
+		ret = mddev->pers->resize(mddev, sectors);
+		if (ret)
+			printk(KERN_ERR "md: %s: resize to %llu sectors from another node failed: %d\n",
+			       mdname(mddev), (unsigned long long)sectors, ret);
+		else
+			revalidate_disk(mddev->gendisk);
+	}
+	mddev_unlock(mddev);
+	return;
+ retry:
+	queue_delayed_work(md_misc_wq, &mddev->resize_work, HZ);
+}
+
+int md_apply_resize(struct mddev *mddev, sector_t dev_sectors)
+{
+	mddev->remote_sectors = dev_sectors;
+	queue_delayed_work(md_misc_wq, &mddev->resize_work, 0);
+	return 0;
+}
+EXPORT_SYMBOL(md_apply_resize);
+
+/* no remote resize may run once the array is going away */
+void md_cancel_resize(struct mddev *mddev)
+{
+	cancel_delayed_work_sync(&mddev->resize_work);
+	mddev->remote_sectors = 0;
+}
+EXPORT_SYMBOL(md_cancel_resize);
+
+/* -ENOENT if the lvb does not describe the members we know */
+static int md_apply_meta_lvb(struct mddev *mddev, struct meta_lvb *lvb)
+{
+	struct meta_lvb_rdev *r;
+	u32 i, nr = le32_to_cpu(lvb->nr);
+
+	if (nr > META_LVB_RDEVS)
+		return -ENOENT;
+	for (i = 0; i < nr; i++) {
+		r = &lvb->rdevs[i];
+		if (md_apply_rdev_state(mddev, le32_to_cpu(r->desc_nr),
+					(s16)le16_to_cpu(r->role),
+					le16_to_cpu(r->state),
+					le64_to_cpu(r->recovery_offset)))
+			return -ENOENT;
+	}
+	md_apply_events(mddev, le64_to_cpu(lvb->events),
+			le64_to_cpu(lvb->recovery_cp));
+	return 0;
+}
+
+/*
+ * catch up with a METADATA_UPDATED, or a delta this node could not
+ * apply.  Taking PR brings in the lvb the writer published; while its
+ * generation is the one we know it is applied in memory, otherwise the
+ * superblocks are read under PR.  An lvb the dlm could not vouch for
+ * (its last EX holder died) counts as a new generation.
+ */
+static void md_refresh_super(struct mddev *mddev, u64 events, u64 changed)
+{
+	struct dlm_lock_resource *res = mddev->dlm_md_meta;
+	struct meta_lvb *lvb;
+	int valid;
+
+	if (md_lock_super(mddev, DLM_LOCK_PR)) {
+		md_reload_superblock(mddev, changed);
+		return;
+	}
+	lvb = (struct meta_lvb *)res->lksb.sb_lvbptr;
+	valid = !(res->lksb.sb_flags & DLM_SBF_VALNOTVALID);
+	if (!valid ||
+	    le64_to_cpu(lvb->generation) != mddev->meta_gen ||
+	    le64_to_cpu(lvb->events) < events ||
+	    md_apply_meta_lvb(mddev, lvb)) {
+		md_reload_superblock(mddev, changed);
+		if (valid)
+			mddev->meta_gen = le64_to_cpu(lvb->generation);
+	}
+	md_unlock_super(mddev);
+}
+
+static void md_refresh_work(struct work_struct *ws)
+{
+	struct mddev *mddev = container_of(ws, struct mddev, refresh_work);
+	u64 events, changed;
+
+	spin_lock(&mddev->refresh_lock);
+	events = mddev->refresh_events;
+	changed = mddev->refresh_changed;
+	mddev->refresh_events = 0;
+	mddev->refresh_changed = 0;
+	spin_unlock(&mddev->refresh_lock);
+	md_refresh_super(mddev, events, changed);
+}
+
+/* called from raid1d, which must not wait for the dlm */
+void md_queue_refresh(struct mddev *mddev, u64 events, u64 changed)
+{
+	spin_lock(&mddev->refresh_lock);
+	mddev->refresh_events = max(mddev->refresh_events, events);
+	mddev->refresh_changed |= changed;
+	spin_unlock(&mddev->refresh_lock);
+	queue_work(md_misc_wq, &mddev->refresh_work);
+}
+EXPORT_SYMBOL(md_queue_refresh);
+
 #ifndef MODULE
 
 /*
@@ -90,6 +90,8 @@ struct md_rdev {
 					 * recovered, this is where we were
 					 * up to.
 					 */
+	int		remote_state;	/* MD_DISK_* bits and recovery_offset */
+	sector_t	remote_offset;	/* another node reported, see RemoteState */
 
 	atomic_t	nr_pending;	/* number of pending requests.
 					 * only maintained for arrays that
@@ -168,6 +170,10 @@ enum flag_bits {
 				 * a want_replacement device with same
 				 * raid_disk number.
 				 */
+	RemoteState,		/* remote_state/remote_offset came from
+				 * another node and wait for
+				 * md_check_recovery to apply them
+				 */
 };
 
 #define BB_LEN_MASK	(0x00000000000001FFULL)
@@ -231,13 +237,19 @@ struct dlm_md_msg {
 
 
 
-#define METADATA_UPDATED	(0)
+#define METADATA_UPDATED	(0)	/* low: events, high: sb_written */
 #define RESYNC_FINISHED	(1)
 #define SUSPEND_RANGE		(2)
+/* deltas of what md_update_sb wrote, applied in memory by receivers */
+#define EVENTS_UPDATED		(3)	/* low: events, high: recovery_cp */
+#define RDEV_STATE		(4)	/* bitmap: desc_nr, low: role << 32 |
+					 * MD_DISK_* bits, high: recovery_offset */
+#define ARRAY_RESIZED		(5)	/* low: dev_sectors */
 #define MAX_MSG_LEN		(sizeof(struct msg_suspend))
-#define PER_NODE_COUNTER	(32)
+#define PER_NODE_COUNTER	(4096)	/* event counter page ahead of each
+					 * node's bits */
 #define CLUSTER_MD_MSG_MIN	METADATA_UPDATED
-#define CLUSTER_MD_MSG_MAX	SUSPEND_RANGE
+#define CLUSTER_MD_MSG_MAX	ARRAY_RESIZED
 
 struct msg_entry {
 	int type;
@@ -251,11 +263,87 @@ struct cluster_msg {
 	sector_t high;
 };
 
+/*
+ * lvb length of the md lockspace. The MESSAGE lvb carries a batch of
+ * cluster_msg records, everything queued on send_list while TOKEN is
+ * held goes out in one TOKEN/MESSAGE/ACK round.
+ */
+#define MSG_LVB_SIZE		(256)
+
+struct msg_batch {
+	__le32 count;
+	__le32 pad;
+	struct cluster_msg msgs[0];
+};
+
+#define MAX_BATCH_MSGS		((MSG_LVB_SIZE - sizeof(struct msg_batch)) / \
+				 sizeof(struct cluster_msg))
+
+/*
+ * lvb of dlm_md_meta, filled by md_update_sb under EX and published
+ * when the cached lock is given up.  The generation only moves when
+ * the member set or the size changes; while it is unchanged the rest
+ * is enough to bring another node up to date without reading disks.
+ */
+struct meta_lvb_rdev {
+	__le32 desc_nr;
+	__le16 role;
+	__le16 state;		/* MD_DISK_* bits */
+	__le64 recovery_offset;
+};
+
+struct meta_lvb {
+	__le64 generation;
+	__le64 events;
+	__le64 recovery_cp;
+	__le64 dev_sectors;
+	__le64 members;		/* desc_nr mask */
+	__le32 raid_disks;
+	__le32 nr;		/* rdevs[] used, ~0 when they did not fit */
+	struct meta_lvb_rdev rdevs[0];
+};
+
+#define META_LVB_RDEVS		((MSG_LVB_SIZE - sizeof(struct meta_lvb)) / \
+				 sizeof(struct meta_lvb_rdev))
+
+/*
+ * Bitmap resync after node failures is split into this many regions,
+ * each with its own lock, so the surviving nodes can share the work.
+ * A region lock is held NL when idle and EX while a node resyncs it.
+ * Its lvb is a bitmap of the nodes whose bitmaps the region has been
+ * resynced for.
+ */
+#define MD_RESYNC_REGIONS	64
+
 struct suspend_range_list {
 	struct list_head list;
 	int bitmap;
 	sector_t low;
 	sector_t high;
+	struct rcu_head rcu;
+	/* writes waiting for this range to move past them. lock
+	 * protects deferred, dead and updates of low/high.
+	 */
+	spinlock_t lock;
+	int dead;
+	struct bio_list deferred;
+};
+
+/*
+ * sorted snapshot of mddev->suspend_range for lock-free lookup in the
+ * I/O path. Entries are ordered by low, max_high is the largest high
+ * of this and all earlier entries, so an overlap check is a binary
+ * search. raid1d rebuilds and republishes it whenever the list changes.
+ */
+struct suspend_index {
+	struct rcu_head rcu;
+	int count;
+	struct suspend_index_entry {
+		sector_t low;
+		sector_t high;
+		sector_t max_high;
+		struct suspend_range_list *range;
+	} entries[0];
 };
 
 typedef int (*msg_handle)(struct mddev *mddev, struct msg_entry *entry);
@@ -361,6 +449,8 @@ struct mddev {
 	 * we are certain of.
 	 */
 	sector_t			curr_resync_completed;
+	sector_t			region_start;	/* start of the resync region
+							 * this node is working on */
 	unsigned long			resync_mark;	/* a recent timestamp */
 	sector_t			resync_mark_cnt;/* blocks written at resync_mark */
 	sector_t			curr_mark_cnt; /* blocks scheduled now */
@@ -459,6 +549,13 @@ struct mddev {
 	spinlock_t			write_lock;
 	wait_queue_head_t		sb_wait;	/* for waiting on superblock updates */
 	atomic_t			pending_writes;	/* number of active superblock writes */
+	atomic_t			pending_reads;	/* superblock reads of a remote update */
+	sector_t			remote_sectors;	/* dev_sectors another node resized
+							 * to, 0 when none is pending */
+	struct delayed_work		resize_work;	/* applies remote_sectors */
+	u64				sb_written;	/* desc_nr mask of the superblocks
+							 * the last md_update_sb wrote,
+							 * ~0 when one is beyond 63 */
 
 	unsigned int			safemode;	/* if set, update "clean" superblock
 							 * when no writes pending.
@@ -498,6 +595,7 @@ struct mddev {
 	dlm_lockspace_t *dlm_md_lockspace;
 	struct dlm_lock_resource *dlm_md_meta; /* lock for metadata. */
 	struct dlm_lock_resource *dlm_md_resync; /* lock for resync/recovery. */
+	struct dlm_lock_resource *dlm_md_region[MD_RESYNC_REGIONS];
 
 	/*for adding new spare disk*/
 	struct dlm_lock_resource *no_new_devs; 
@@ -511,16 +609,34 @@ struct mddev {
 	struct dlm_lock_resource *dlm_md_token;
 	struct dlm_lock_resource *dlm_md_ack;
 
-	/* linked list for bitmap resources. */
-	struct list_head dlm_md_bitmap;
+	/* bitmap lock resources, indexed by bitmap number. */
+	struct dlm_lock_resource **dlm_md_bitmap;
+	/* avail_mutex serialises the bitmap lock work and resync
+	 * working on the avail set. The bits themselves are atomic, the
+	 * bitmap lock callbacks set and clear them directly.
+	 */
 	struct mutex avail_mutex;
-	struct mutex reclaim_mutex;
-	int *avail_bitmap;
-	int *reclaim_bitmap;
+	unsigned long *avail_bitmap;	/* bitmaps we hold CR on */
+	unsigned long *reclaim_bitmap;	/* bitmaps others want EX on */
 	struct mutex sb_mutex;
+	/* dlm_md_meta stays granted in meta_mode after md_unlock_super,
+	 * until a bast says another node wants it; it then goes back to
+	 * NL (DLM_LOCK_IV before the first request).
+	 */
+	int meta_mode;
+	int meta_contended;
+	u64 meta_gen;		/* meta_lvb generation we are current with */
+	struct work_struct meta_release;
+	/* a METADATA_UPDATED waits for PR on dlm_md_meta, done from
+	 * md_misc_wq so raid1d keeps going meanwhile */
+	spinlock_t refresh_lock;
+	u64 refresh_events;
+	u64 refresh_changed;
+	struct work_struct refresh_work;
 
 	/*suspend range list*/
 	struct list_head  suspend_range;
+	struct suspend_index __rcu *suspend_index;
 
 	atomic_t 			max_corr_read_errors; /* max read retries */
 	struct list_head		all_mddevs;
@@ -694,9 +810,14 @@ extern int mddev_congested(struct mddev *mddev, int bits);
 extern void md_flush_request(struct mddev *mddev, struct bio *bio);
 extern void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
 			   sector_t sector, int size, struct page *page);
+extern void md_super_write_pages(struct mddev *mddev, struct md_rdev *rdev,
+				 sector_t sector, int size,
+				 struct page **pages, int nr);
 extern void md_super_wait(struct mddev *mddev);
 extern int sync_page_io(struct md_rdev *rdev, sector_t sector, int size, 
 			struct page *page, int rw, bool metadata_op);
+extern int sync_pages_io(struct md_rdev *rdev, sector_t sector, int size,
+			 struct page **pages, int nr, int rw, bool metadata_op);
 extern void md_do_sync(struct md_thread *thread);
 extern void md_new_event(struct mddev *mddev);
 extern int md_allow_write(struct mddev *mddev);
@@ -735,10 +856,22 @@ extern int dlm_unlock_sync(dlm_lockspace_t *ls, struct dlm_lock_resource *res);
 
 extern int md_lock_super(struct mddev *mddev, int mode);
 extern void md_unlock_super(struct mddev *mddev);
-extern int md_send_metadata_update(struct mddev *mddev, int async);
-extern int md_send_suspend(struct mddev *mddev, sector_t sus_start, 
-		sector_t sus_end);
-extern void md_reload_superblock(struct mddev *mddev);
+extern void md_drop_super(struct mddev *mddev);
+extern int md_send_metadata_update(struct mddev *mddev, u64 changed,
+				   int async);
+extern int md_send_resync_finished(struct mddev *mddev, int bmpno);
+extern int md_send_suspend(struct mddev *mddev, int bmpno, sector_t sus_start,
+		sector_t sus_end, int async);
+extern int md_send_sb_delta(struct mddev *mddev, int devs, int async);
+extern int md_send_resize(struct mddev *mddev, int async);
+extern void md_reload_superblock(struct mddev *mddev, u64 changed);
+extern void md_apply_events(struct mddev *mddev, u64 events,
+			    sector_t recovery_cp);
+extern int md_apply_rdev_state(struct mddev *mddev, int nr, int role,
+		int state, sector_t offset);
+extern void md_queue_refresh(struct mddev *mddev, u64 events, u64 changed);
+extern int md_apply_resize(struct mddev *mddev, sector_t dev_sectors);
+extern void md_cancel_resize(struct mddev *mddev);
 /* FIXME? are these internal functions */
 void deinit_lock_resource(struct dlm_lock_resource *res);
 struct dlm_lock_resource *init_lock_resource(struct mddev *mddev, char *name);
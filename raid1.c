@@ -37,6 +37,8 @@
 #include <linux/module.h>
 #include <linux/seq_file.h>
 #include <linux/ratelimit.h>
+#include <linux/sort.h>
+#include <linux/rcupdate.h>
 #include "md.h"
 #include "raid1.h"
 #include "bitmap.h"
@@ -66,6 +68,10 @@
  */
 static int max_queued_requests = 1024;
 
+/* resubmits writes released from a suspend window, it must make
+ * progress under memory pressure as they may be writeback */
+static struct workqueue_struct *raid1_deferred_wq;
+
 static void allow_barrier(struct r1conf *conf);
 static void lower_barrier(struct r1conf *conf);
 
@@ -88,6 +94,8 @@ static void r1bio_pool_free(void *r1_bio, void *data)
 #define RESYNC_SECTORS (RESYNC_BLOCK_SIZE >> 9)
 #define RESYNC_PAGES ((RESYNC_BLOCK_SIZE + PAGE_SIZE-1) / PAGE_SIZE)
 #define RESYNC_WINDOW (2048*1024)
+/* suspend window announced to other nodes during resync, in sectors */
+#define RESYNC_SUSPEND_WINDOW ((8*1024*1024) >> 9)
 
 static void * r1buf_pool_alloc(gfp_t gfp_flags, void *data)
 {
@@ -479,6 +487,177 @@ static void raid1_end_write_request(struct bio *bio, int error)
 }
 
 
+static int suspend_entry_cmp(const void *a, const void *b)
+{
+	const struct suspend_index_entry *x = a, *y = b;
+
+	if (x->low < y->low)
+		return -1;
+	return x->low > y->low;
+}
+
+/*
+ * rebuild the sorted index of mddev->suspend_range and publish it.
+ * Only raid1d changes the list, so no locking is needed against
+ * other writers. The old index may still point at a range that is
+ * being freed, so this must not fail.
+ */
+static void publish_suspend_index(struct mddev *mddev)
+{
+	struct suspend_index *new, *old;
+	struct suspend_range_list *suspend;
+	int i, count = 0;
+
+	list_for_each_entry(suspend, &mddev->suspend_range, list)
+		count++;
+	new = NULL;
+	if (count) {
+		new = kmalloc(sizeof(*new) +
+			      count * sizeof(struct suspend_index_entry),
+			      GFP_NOIO | __GFP_NOFAIL);
+		i = 0;
+		list_for_each_entry(suspend, &mddev->suspend_range, list) {
+			new->entries[i].low = suspend->low;
+			new->entries[i].high = suspend->high;
+			new->entries[i].range = suspend;
+			i++;
+		}
+		new->count = count;
+		sort(new->entries, count, sizeof(struct suspend_index_entry),
+		     suspend_entry_cmp, NULL);
+		new->entries[0].max_high = new->entries[0].high;
+		for (i = 1; i < count; i++)
+			new->entries[i].max_high = max(new->entries[i-1].max_high,
+						       new->entries[i].high);
+	}
+	old = rcu_dereference_protected(mddev->suspend_index, 1);
+	rcu_assign_pointer(mddev->suspend_index, new);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/*
+ * find a suspended range overlapping [lo, hi).
+ * Must be called under rcu_read_lock(), the returned range is only
+ * valid until rcu_read_unlock().
+ */
+static struct suspend_range_list *find_suspend_range(struct mddev *mddev,
+						     sector_t lo, sector_t hi)
+{
+	struct suspend_index *idx = rcu_dereference(mddev->suspend_index);
+	int l, r, i;
+
+	if (!idx)
+		return NULL;
+	/* last entry starting below hi */
+	l = 0;
+	r = idx->count;
+	while (l < r) {
+		int m = (l + r) / 2;
+		if (idx->entries[m].low < hi)
+			l = m + 1;
+		else
+			r = m;
+	}
+	for (i = l - 1; i >= 0 && idx->entries[i].max_high > lo; i--)
+		if (idx->entries[i].high > lo)
+			return idx->entries[i].range;
+	return NULL;
+}
+
+/*
+ * park a write that falls into a range another node is resyncing on
+ * that range. Returns 1 if the bio was parked.
+ */
+static int defer_suspended_write(struct mddev *mddev, struct bio *bio)
+{
+	struct suspend_range_list *suspend;
+	int parked = 0;
+
+	rcu_read_lock();
+	suspend = find_suspend_range(mddev, bio->bi_sector,
+				     bio_end_sector(bio));
+	if (suspend) {
+		/* recheck, the index may be older than the range */
+		spin_lock(&suspend->lock);
+		if (!suspend->dead && bio->bi_sector < suspend->high &&
+		    bio_end_sector(bio) > suspend->low) {
+			/* still in flight as far as mddev_suspend() goes */
+			atomic_inc(&mddev->active_io);
+			bio_list_add(&suspend->deferred, bio);
+			parked = 1;
+		}
+		spin_unlock(&suspend->lock);
+	}
+	rcu_read_unlock();
+	return parked;
+}
+
+/* drop the reference a parked write held, as md_make_request does */
+static void put_parked_write(struct mddev *mddev)
+{
+	if (atomic_dec_and_test(&mddev->active_io) && mddev->suspended)
+		wake_up(&mddev->sb_wait);
+}
+
+/*
+ * hand the writes parked on suspend which it no longer covers to
+ * deferred_work, all of them once the range is dead.
+ */
+static void release_suspended_writes(struct r1conf *conf,
+				     struct suspend_range_list *suspend)
+{
+	struct bio_list keep, release;
+	struct bio *bio;
+
+	bio_list_init(&keep);
+	bio_list_init(&release);
+	spin_lock(&suspend->lock);
+	while ((bio = bio_list_pop(&suspend->deferred))) {
+		if (!suspend->dead && bio->bi_sector < suspend->high &&
+		    bio_end_sector(bio) > suspend->low)
+			bio_list_add(&keep, bio);
+		else
+			bio_list_add(&release, bio);
+	}
+	suspend->deferred = keep;
+	spin_unlock(&suspend->lock);
+
+	if (bio_list_empty(&release))
+		return;
+	spin_lock(&conf->deferred_lock);
+	bio_list_merge(&conf->deferred_writes, &release);
+	spin_unlock(&conf->deferred_lock);
+	queue_work(raid1_deferred_wq, &conf->deferred_work);
+}
+
+/*
+ * resubmit released writes from process context. raid1d cannot do
+ * this itself as make_request may wait on the barrier or for a
+ * superblock update, both of which need raid1d. They go straight
+ * back to the personality: md_make_request has accounted them once.
+ */
+static void raid1_deferred_work(struct work_struct *ws)
+{
+	struct r1conf *conf = container_of(ws, struct r1conf, deferred_work);
+	struct mddev *mddev = conf->mddev;
+	struct bio_list bios;
+	struct blk_plug plug;
+	struct bio *bio;
+
+	spin_lock(&conf->deferred_lock);
+	bios = conf->deferred_writes;
+	bio_list_init(&conf->deferred_writes);
+	spin_unlock(&conf->deferred_lock);
+
+	blk_start_plug(&plug);
+	while ((bio = bio_list_pop(&bios))) {
+		mddev->pers->make_request(mddev, bio);
+		put_parked_write(mddev);
+	}
+	blk_finish_plug(&plug);
+}
+
 /*
  * This routine returns the disk from which the requested read should
  * be done. There is a per-array 'next expected sequential IO' sector
@@ -512,6 +691,9 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
 	 * Check if we can balance. We can balance on the whole
 	 * device if no resync is going on, or below the resync window.
 	 * We take the first readable disk when above the resync window.
+	 * The same goes for a range another node is resyncing: it reads
+	 * from the first readable disk too, so only that one is known to
+	 * hold the data the other mirrors are being synced to.
 	 */
  retry:
 	sectors = r1_bio->sectors;
@@ -524,8 +706,11 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
 	has_nonrot_disk = 0;
 	choose_next_idle = 0;
 
-	if (conf->mddev->recovery_cp < MaxSector &&
-	    (this_sector + sectors >= conf->next_resync))
+	if ((conf->mddev->recovery_cp < MaxSector &&
+	     (this_sector + sectors >= conf->next_resync)) ||
+	    (test_bit(MD_NODE_SYNCING, &conf->mddev->flags) &&
+	     find_suspend_range(conf->mddev, this_sector,
+				this_sector + sectors)))
 		choose_first = 1;
 	else
 		choose_first = 0;
@@ -1014,7 +1199,6 @@ static void make_request(struct mddev *mddev, struct bio * bio)
 	int first_clone;
 	int sectors_handled;
 	int max_sectors;
-	struct suspend_range_list *suspend;
 
 	/*
 	 * Register the new request and wait if the reconstruction
@@ -1022,6 +1206,14 @@ static void make_request(struct mddev *mddev, struct bio * bio)
 	 * Continue immediately if no resync is active currently.
 	 */
 
+	/*
+	 * a write into a range another node is resyncing waits on that
+	 * range, and is resubmitted once the range moves past it.
+	 */
+	if (rw == WRITE && test_bit(MD_NODE_SYNCING, &mddev->flags) &&
+	    defer_suspended_write(mddev, bio))
+		return;
+
 	md_write_start(mddev, bio); /* wait on superblock update early */
 
 	if (bio_data_dir(bio) == WRITE &&
@@ -1061,28 +1253,6 @@ static void make_request(struct mddev *mddev, struct bio * bio)
 	r1_bio->mddev = mddev;
 	r1_bio->sector = bio->bi_sector;
 
-	/*
-	 * when bio is write and it is in one of the suspend_range list,
-	 * put this bio into the retry list
-	 * */
-	if (test_bit(MD_NODE_SYNCING, &mddev->flags)) {
-		list_for_each_entry(suspend, 
-				&mddev->suspend_range, list)
-			if (rw == WRITE && bio->bi_sector < suspend->high &&
-					bio_end_sector(bio) > suspend->low) {
-				list_add(&r1_bio->retry_list, &conf->retry_list);
-				conf->nr_queued++;
-				return;
-			} else if (rw == READ && bio->bi_sector < suspend->high 
-					&& bio_end_sector(bio) > suspend->low) {
-				//TODO
-				/*
-				 * select the wright device to read
-				 **/
-				return;
-			}
-	}
-
 	/* We might need to issue multiple reads to different
 	 * devices if there are bad blocks around, so we keep
 	 * track of the number of reads in bio->bi_phys_segments.
@@ -2319,61 +2489,114 @@ read_more:
 
 int handle_metadata_update(struct mddev *mddev, struct msg_entry *entry)
 {
-	md_reload_superblock(mddev);
+	struct cluster_msg *msg = (struct cluster_msg *)entry->buf;
+
+	md_queue_refresh(mddev, le64_to_cpu(msg->low),
+			 le64_to_cpu(msg->high));
 	return 0;
 }
 
+int handle_events_updated(struct mddev *mddev, struct msg_entry *entry)
+{
+	struct cluster_msg *msg = (struct cluster_msg *)entry->buf;
+
+	md_apply_events(mddev, le64_to_cpu(msg->low),
+			le64_to_cpu(msg->high));
+	return 0;
+}
+
+int handle_rdev_state(struct mddev *mddev, struct msg_entry *entry)
+{
+	struct cluster_msg *msg = (struct cluster_msg *)entry->buf;
+	u64 state = le64_to_cpu(msg->low);
+
+	/* a member we don't know in that role: catch up from the
+	 * metadata lvb, or re-read them all */
+	if (md_apply_rdev_state(mddev, le32_to_cpu(msg->bitmap),
+				(int)(u32)(state >> 32), (u32)state,
+				le64_to_cpu(msg->high)))
+		md_queue_refresh(mddev, 0, ~0ULL);
+	return 0;
+}
+
+int handle_array_resized(struct mddev *mddev, struct msg_entry *entry)
+{
+	struct cluster_msg *msg = (struct cluster_msg *)entry->buf;
+
+	return md_apply_resize(mddev, le64_to_cpu(msg->low));
+}
+
 int handle_resync_finished(struct mddev *mddev, struct msg_entry *entry)
 {
 	struct cluster_msg *msg = (struct cluster_msg *)entry->buf;
 	int bmpno = le32_to_cpu(msg->bitmap);
 	struct suspend_range_list *tmp = NULL, *suspend;
-	int ret = 0;
 
+	/* finishing the resync of a failed node's bitmap needs no action
+	 * here, only the resyncing node's own slot has a suspend window.
+	 */
 	list_for_each_entry(suspend, &mddev->suspend_range, list)
 		if (suspend->bitmap == bmpno) {
 			tmp = suspend;
 			break;
 		}
-	if (!tmp) {
-		printk(KERN_ERR "md/raid1: received wrong bitmap number:%d\n", bmpno);
-		ret = -1;
-		goto out;
-	}
+	if (!tmp)
+		return 0;
+	spin_lock(&tmp->lock);
+	tmp->dead = 1;
+	spin_unlock(&tmp->lock);
 	list_del(&tmp->list);
-	kfree(tmp);
 	if (list_empty(&mddev->suspend_range))
 		clear_bit(MD_NODE_SYNCING, &mddev->flags);
+	publish_suspend_index(mddev);
+	release_suspended_writes(mddev->private, tmp);
+	kfree_rcu(tmp, rcu);
 	md_wakeup_thread(mddev->thread);
-out:
-	return ret;
+	return 0;
 }
 
 int handle_suspend_range(struct mddev *mddev, struct msg_entry *entry)
 {
 	struct cluster_msg *msg = (struct cluster_msg *)entry->buf;
+	int bmpno = le32_to_cpu(msg->bitmap);
 	sector_t suspend_hi = le64_to_cpu(msg->high);
 	sector_t suspend_lo = le64_to_cpu(msg->low);
+	struct suspend_range_list *suspend;
 
-	struct suspend_range_list *suspend = kzalloc(
-			sizeof(struct suspend_range_list), GFP_KERNEL);
+	/* a node keeps one window, which slides forward as it resyncs */
+	list_for_each_entry(suspend, &mddev->suspend_range, list)
+		if (suspend->bitmap == bmpno)
+			goto found;
+
+	suspend = kzalloc(sizeof(struct suspend_range_list), GFP_KERNEL);
 	if (!suspend) {
 		printk(KERN_ERR "md/raid1: cannot allocate memory.\n");
 		return -ENOMEM;
 	}
-
+	suspend->bitmap = bmpno;
+	spin_lock_init(&suspend->lock);
+	bio_list_init(&suspend->deferred);
+	list_add(&suspend->list, &mddev->suspend_range);
+found:
+	spin_lock(&suspend->lock);
 	suspend->high = suspend_hi;
 	suspend->low = suspend_lo;
-	list_add(&suspend->list, &mddev->suspend_range);
+	spin_unlock(&suspend->lock);
+	publish_suspend_index(mddev);
 	/*set MD_NODE_SYNCING flag*/
 	set_bit(MD_NODE_SYNCING, &mddev->flags);
+	/* writes parked below the new low may go now */
+	release_suspended_writes(mddev->private, suspend);
 	return 0;
 }
 
 static struct msg_handle_struct handler[] = {
 	{METADATA_UPDATED, handle_metadata_update},
 	{RESYNC_FINISHED,  handle_resync_finished},
-	{SUSPEND_RANGE,    handle_suspend_range}
+	{SUSPEND_RANGE,    handle_suspend_range},
+	{EVENTS_UPDATED,   handle_events_updated},
+	{RDEV_STATE,       handle_rdev_state},
+	{ARRAY_RESIZED,    handle_array_resized}
 };
 
 static void raid1d(struct md_thread *thread)
@@ -2384,66 +2607,12 @@ static void raid1d(struct md_thread *thread)
 	struct r1conf *conf = mddev->private;
 	struct list_head *head = &conf->retry_list;
 	struct blk_plug plug;
-	struct dlm_lock_resource *res;
-	int i, ret;
-	struct bitmap *bmp;
-	struct suspend_range_list *suspend, *tmp;
+	int ret;
 
-	bmp = mddev->bitmap;
 	md_check_recovery(mddev);
-	/* handle raid1 cores here.
-	 * message handling, reclaim bitmap locks if we 
-	 * block others to upgrade to EX, bitmap choose.
+	/* handle raid1 cores here: message handling. Choosing and
+	 * handing back bitmap locks is done by bitmap_lock_work().
 	 */
-	/* choose one bitmap for our usage. */
-	mutex_lock(&mddev->avail_mutex);
-	if (bmp->used == -1) {
-		for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-			if (mddev->avail_bitmap[i] == -1) {
-				continue;
-			}
-			res = find_bitmap_by_node(mddev, mddev->avail_bitmap[i]);
-			res->mode = DLM_LOCK_EX;
-			res->finished = 0;
-			res->flags = DLM_LKF_CONVERT | DLM_LKF_NOQUEUE;
-			ret = bitmap_lock_sync(res);
-			if (!ret) {
-				wake_up(&mddev->bitmap_wait);
-				/* exclude this from avail bitmaps? */
-				mddev->avail_bitmap[i] = -1;
-				break;
-			}
-		}
-	}
-	mutex_unlock(&mddev->avail_mutex);
-
-	/* we are block others upgrade to EX. */
-	mutex_lock(&mddev->reclaim_mutex);
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->reclaim_bitmap[i] == -1) {
-			continue;
-		}
-		/* COMPILE */
-		/* theoritically, this cannot happen. */
-		if (mddev->reclaim_bitmap[i] == bmp->used) {
-			mddev->reclaim_bitmap[i] = -1;
-			continue;
-		}
-		res = find_bitmap_by_node(mddev, mddev->avail_bitmap[i]);
-		res->finished = 0;
-		bitmap_unlock_sync(res);
-		/* unlock and then rerequest lock. */
-		res->mode = DLM_LOCK_CR;
-		res->finished = 0;
-		res->flags = 0;
-		ret = bitmap_lock_async(res);
-		if (ret) {
-			printk(KERN_WARNING "request CR on bitmap %d failed!\n",
-				mddev->reclaim_bitmap[i]);
-		}
-		mddev->reclaim_bitmap[i] = -1;
-	}
-	mutex_unlock(&mddev->reclaim_mutex);
 	/* message handling.. */
 	if (mddev->msg_recvd) {
 		if (mddev->msg_recvd->type >= CLUSTER_MD_MSG_MIN
@@ -2470,19 +2639,6 @@ static void raid1d(struct md_thread *thread)
 			break;
 		}
 		r1_bio = list_entry(head->prev, struct r1bio, retry_list);
-		/*
-		 * whether this bio is still in the suspend_range list
-		 * */
-		list_for_each_entry(suspend, &mddev->suspend_range, list)
-			if (r1_bio->sector < suspend->high &&
-					r1_bio->sector + r1_bio->sectors > suspend->low) {
-				tmp = suspend;
-				break;
-			}
-		if (tmp) {
-			tmp = NULL;
-			continue;
-		}
 		list_del(head->prev);
 		conf->nr_queued--;
 		spin_unlock_irqrestore(&conf->device_lock, flags);
@@ -2525,6 +2681,10 @@ static int init_resync(struct r1conf *conf)
 	if (!conf->r1buf_pool)
 		return -ENOMEM;
 	conf->next_resync = 0;
+	conf->suspend_sent_hi = 0;
+	conf->suspend_acked_hi = 0;
+	conf->suspend_base = 0;
+	conf->suspend_failed = 0;
 	return 0;
 }
 
@@ -2548,11 +2708,11 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 	int i, rv;
 	int wonly = -1;
 	int write_targets = 0, read_targets = 0;
-	sector_t sync_blocks, oldsync_blocks;
+	sector_t sync_blocks;
 	int still_degraded = 0;
 	int good_sectors = RESYNC_SECTORS;
 	int min_bad = 0; /* number of sectors that are bad in all devices */
-	sector_t sus_start, sus_end;
+	sector_t sus_start, sus_end, sus_max;
 
 	sus_start = sector_nr;
 	if (!conf->r1buf_pool)
@@ -2566,24 +2726,18 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 		 * only be one in raid1 resync.
 		 * We can find the current addess in mddev->curr_resync
 		 */
-		if (mddev->curr_resync < max_sector) {/* aborted */
-			for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-				if (mddev->avail_bitmap[i] == -1) {
-					continue;
-				}
-				bitmap_end_sync(mddev->bitmap, mddev->avail_bitmap[i], 
-						mddev->curr_resync,
-						&sync_blocks, 1);
-			}
-		}
+		if (mddev->curr_resync < max_sector) /* aborted */
+			bitmap_end_sync_nodes(mddev->bitmap, mddev->avail_bitmap,
+					      mddev->curr_resync,
+					      &sync_blocks, 1);
 		else /* completed sync */
 			conf->fullsync = 0;
 
-		for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-			if (mddev->avail_bitmap[i] == -1) {
-				continue;
-			}
-			bitmap_close_sync(mddev->bitmap, mddev->avail_bitmap[i]);
+		bitmap_close_sync_nodes(mddev->bitmap, mddev->avail_bitmap);
+		/* release the suspend window on the other nodes */
+		if (conf->suspend_bitmap != -1) {
+			md_send_resync_finished(mddev, conf->suspend_bitmap);
+			conf->suspend_bitmap = -1;
 		}
 		close_sync(conf);
 		return 0;
@@ -2599,25 +2753,8 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 	/* before building a request, check if we can skip these blocks..
 	 * This call the bitmap_start_sync doesn't actually record anything
 	 */
-	rv = 0;
-	oldsync_blocks = 0;
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->avail_bitmap[i] == -1) {
-			continue;
-		}
-		rv |= bitmap_start_sync(mddev->bitmap, mddev->avail_bitmap[i],
-				sector_nr, &sync_blocks, 1);
-		if (rv) {
-			if (oldsync_blocks == 0) {
-				oldsync_blocks = sync_blocks;
-			} else {
-				if (sync_blocks < oldsync_blocks) {
-					oldsync_blocks = sync_blocks;
-				}
-			}
-		}
-	}
-	sync_blocks = oldsync_blocks;
+	rv = bitmap_start_sync_nodes(mddev->bitmap, mddev->avail_bitmap,
+				     sector_nr, &sync_blocks, 1);
 	if (!rv && !conf->fullsync && !test_bit(MD_RECOVERY_REQUESTED, &mddev->recovery)) {
 		/* We can skip this block, and probably several more */
 		*skipped = 1;
@@ -2631,12 +2768,7 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 	if (!go_faster && conf->nr_waiting)
 		msleep_interruptible(1000);
 
-	for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-		if (mddev->avail_bitmap[i] == -1) {
-			continue;
-		}
-		bitmap_cond_end_sync(mddev->bitmap, mddev->avail_bitmap[i], sector_nr);
-	}
+	bitmap_cond_end_sync_nodes(mddev->bitmap, mddev->avail_bitmap, sector_nr);
 	r1_bio = mempool_alloc(conf->r1buf_pool, GFP_NOIO);
 	raise_barrier(conf);
 
@@ -2776,6 +2908,8 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 		return rv;
 	}
 
+	/* the suspend window may run ahead of this request */
+	sus_max = min(max_sector, mddev->resync_max);
 	if (max_sector > mddev->resync_max)
 		max_sector = mddev->resync_max; /* Don't do IO beyond here */
 	if (max_sector > sector_nr + good_sectors)
@@ -2790,25 +2924,9 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 		if (len == 0)
 			break;
 		if (sync_blocks == 0) {
-			rv = 0;
-			oldsync_blocks = 0;
-			for (i = 0; i < mddev->bitmap_info.nodes; i++) {
-				if (mddev->avail_bitmap[i] == -1) {
-					continue;
-				}
-				rv |= bitmap_start_sync(mddev->bitmap, mddev->avail_bitmap[i],
-						sector_nr, &sync_blocks, 1);
-				if (rv) {
-					if (oldsync_blocks == 0) {
-						oldsync_blocks = sync_blocks;
-					} else {
-						if (sync_blocks < oldsync_blocks) {
-							oldsync_blocks = sync_blocks;
-						}
-					}
-				}
-			}
-			sync_blocks = oldsync_blocks;
+			rv = bitmap_start_sync_nodes(mddev->bitmap,
+						     mddev->avail_bitmap,
+						     sector_nr, &sync_blocks, 1);
 			if (!rv &&
 			    !conf->fullsync &&
 			    !test_bit(MD_RECOVERY_REQUESTED, &mddev->recovery))
@@ -2847,11 +2965,42 @@ static sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int *skipp
 	r1_bio->sectors = nr_sectors;
 	sus_end = sus_start + nr_sectors;
 
-	/* broadcast out suspend P - Q message and
-	 * waiting for response.
-	 * then continue resync
+	/* keep the suspend window announced to the other nodes well ahead
+	 * of the resync position, sending the next one once we are half way
+	 * through. Only wait when this request runs past the part every
+	 * node has acked.
 	 */
-	md_send_suspend(mddev,sus_start,sus_end);
+	if (conf->suspend_base != mddev->region_start) {
+		/* md_do_sync jumped over regions other nodes handle, start
+		 * a fresh window rather than stretch the old one over them */
+		conf->suspend_base = mddev->region_start;
+		conf->suspend_sent_hi = conf->suspend_base;
+		conf->suspend_acked_hi = conf->suspend_base;
+	}
+	if (conf->suspend_sent_hi < sus_max &&
+	    sus_end + RESYNC_SUSPEND_WINDOW / 2 > conf->suspend_sent_hi) {
+		sector_t lo = max(min(mddev->curr_resync_completed, sus_start),
+				  conf->suspend_base);
+		sector_t hi = min(sus_end + RESYNC_SUSPEND_WINDOW, sus_max);
+
+		if (conf->suspend_bitmap == -1 && mddev->bitmap)
+			conf->suspend_bitmap = mddev->bitmap->used;
+		if (md_send_suspend(mddev, conf->suspend_bitmap, lo, hi, 1)) {
+			printk(KERN_ERR "md/raid1:%s: failed to send suspend message\n",
+			       mdname(mddev));
+			conf->suspend_failed = 1;
+		} else
+			conf->suspend_sent_hi = hi;
+	}
+	wait_event(conf->suspend_wait, conf->suspend_acked_hi >= sus_end ||
+		   conf->suspend_failed);
+	if (conf->suspend_failed) {
+		/* the other nodes may still write here, don't resync it */
+		printk(KERN_ERR "md/raid1:%s: suspend window not acked, aborting resync\n",
+		       mdname(mddev));
+		put_buf(r1_bio);
+		return 0;
+	}
 
 	/* For a user-requested sync, we read all readable devices and do a
 	 * compare
@@ -2947,6 +3096,11 @@ static struct r1conf *setup_conf(struct mddev *mddev)
 
 	spin_lock_init(&conf->resync_lock);
 	init_waitqueue_head(&conf->wait_barrier);
+	init_waitqueue_head(&conf->suspend_wait);
+	conf->suspend_bitmap = -1;
+	spin_lock_init(&conf->deferred_lock);
+	bio_list_init(&conf->deferred_writes);
+	INIT_WORK(&conf->deferred_work, raid1_deferred_work);
 
 	bio_list_init(&conf->pending_bio_list);
 	conf->pending_count = 0;
@@ -3025,6 +3179,8 @@ static void raid1_recvd(struct md_thread *thread)
 	struct dlm_lock_resource *message = mddev->dlm_md_message;
 	struct cluster_msg *msg;
 	struct msg_entry *entry;
+	struct msg_batch *batch;
+	int count, i;
 
 	/*get CR on Message*/
 	message->state = 0;
@@ -3036,18 +3192,31 @@ static void raid1_recvd(struct md_thread *thread)
 		return;
 	}
 
-	//read lvb and wake up thread to process this message
-	entry = kzalloc(sizeof(struct msg_entry) + sizeof(struct cluster_msg), GFP_KERNEL); 
-	if (!entry) {
+	/* the lvb holds a batch of messages, hand them to raid1d one by one */
+	batch = kmalloc(MSG_LVB_SIZE, GFP_KERNEL);
+	entry = kzalloc(sizeof(struct msg_entry) + sizeof(struct cluster_msg), GFP_KERNEL);
+	if (!batch || !entry) {
 		printk(KERN_ERR "md/raid1:failed to alloc mem\n");
+		kfree(batch);
+		kfree(entry);
 		return;
 	}
-	memcpy(entry->buf, message->lksb.sb_lvbptr, sizeof(struct cluster_msg));
-	msg = (struct cluster_msg *) entry->buf;
-	entry->type = msg->type;
-	mddev->msg_recvd = entry;
-	md_wakeup_thread(mddev->thread);
-	wait_event_interruptible(mddev->recv_wait, mddev->msg_recvd == NULL);
+	memcpy(batch, message->lksb.sb_lvbptr, MSG_LVB_SIZE);
+	count = le32_to_cpu(batch->count);
+	if (count > MAX_BATCH_MSGS) {
+		printk(KERN_ERR "md/raid1:bad message count %d in lvb\n", count);
+		count = 0;
+	}
+	for (i = 0; i < count; i++) {
+		memcpy(entry->buf, &batch->msgs[i], sizeof(struct cluster_msg));
+		msg = (struct cluster_msg *) entry->buf;
+		entry->type = le32_to_cpu(msg->type);
+		mddev->msg_recvd = entry;
+		md_wakeup_thread(mddev->thread);
+		wait_event(mddev->recv_wait, mddev->msg_recvd == NULL);
+	}
+	kfree(entry);
+	kfree(batch);
 
 	/*release CR on ack*/
 	dlm_unlock_sync(mddev->dlm_md_lockspace, ack);
@@ -3065,7 +3234,10 @@ static void raid1_recvd(struct md_thread *thread)
 
 /*
  * thread for sending message
- * QUSTION: whether process message in the send_list in a loop?
+ * all messages queued on send_list by the time TOKEN and MESSAGE are
+ * held are written into the lvb together (up to MAX_BATCH_MSGS), so a
+ * burst of messages costs one TOKEN/MESSAGE/ACK round instead of one
+ * round per message.
  * */
 static void raid1_sendd(struct md_thread *thread)
 {
@@ -3073,7 +3245,12 @@ static void raid1_sendd(struct md_thread *thread)
 	struct dlm_lock_resource *ack = mddev->dlm_md_ack;
 	struct dlm_lock_resource *message = mddev->dlm_md_message;
 	struct dlm_lock_resource *token = mddev->dlm_md_token;
-	struct dlm_md_msg *msg;
+	struct msg_batch *lvb = (struct msg_batch *)message->lksb.sb_lvbptr;
+	struct r1conf *conf = mddev->private;
+	struct dlm_md_msg *msg, *tmp;
+	struct cluster_msg *cmsg;
+	LIST_HEAD(batch);
+	int count;
 	int error = 0;
 
 	if (list_empty(&mddev->send_list)) {
@@ -3081,14 +3258,7 @@ static void raid1_sendd(struct md_thread *thread)
 		return;
 	}
 
-	spin_lock(&mddev->send_lock);
-	while (!list_empty(&mddev->send_list)) {
-		msg = list_entry(mddev->send_list.next,
-				struct dlm_md_msg,
-				list);
-		list_del(&msg->list);
-		spin_unlock(&mddev->send_lock);
-
+	while (!list_empty(&mddev->send_list) && !error) {
 		/*Get EX on Token*/
 		token->state = 0;
 		token->mode = DLM_LOCK_EX;
@@ -3096,7 +3266,8 @@ static void raid1_sendd(struct md_thread *thread)
 		token->parent_lkid = 0;
 		if (dlm_lock_sync(mddev->dlm_md_lockspace, token)) {
 			printk(KERN_ERR "md/raid1:failed to get EX on TOKEN\n");
-			return;
+			error = 1;
+			goto failed_token;
 		}
 
 
@@ -3112,14 +3283,27 @@ static void raid1_sendd(struct md_thread *thread)
 			goto failed_message;
 		}
 
+		/* drain the send_list into the lvb */
+		count = 0;
+		memset(lvb, 0, MSG_LVB_SIZE);
+		spin_lock(&mddev->send_lock);
+		while (!list_empty(&mddev->send_list) && count < MAX_BATCH_MSGS) {
+			msg = list_entry(mddev->send_list.next,
+					struct dlm_md_msg,
+					list);
+			list_move_tail(&msg->list, &batch);
+			memcpy(&lvb->msgs[count++], msg->buf, sizeof(struct cluster_msg));
+		}
+		spin_unlock(&mddev->send_lock);
+		lvb->count = cpu_to_le32(count);
+
 		/*down-convert EX to CR on Message*/
 		message->mode = DLM_LOCK_CR;
 		message->flags = DLM_LKF_CONVERT|DLM_LKF_VALBLK;
-		memcpy(message->lksb.sb_lvbptr, msg->buf, sizeof(struct cluster_msg));
 		if (dlm_lock_sync(mddev->dlm_md_lockspace, message)) {
 			printk(KERN_ERR "md/raid1:failed to convert EX to CR on MESSAGE\n");
 			error = 1;
-			goto failed_message;
+			goto failed_ack;
 		}
 
 		/*up-convert CR to EX on Ack*/
@@ -3147,14 +3331,84 @@ static void raid1_sendd(struct md_thread *thread)
 		dlm_unlock_sync(mddev->dlm_md_lockspace, message);
  failed_message:
 		dlm_unlock_sync(mddev->dlm_md_lockspace, token);
-		msg->sent = 1;
-		wake_up(&msg->waiter);
-		spin_lock(&mddev->send_lock);
-		if (error) break;
+ failed_token:
+		if (error) {
+			/* the loop ends here and nothing wakes us for what
+			 * is still queued: fail it rather than leave the
+			 * senders waiting */
+			spin_lock(&mddev->send_lock);
+			list_splice_tail_init(&mddev->send_list, &batch);
+			spin_unlock(&mddev->send_lock);
+		}
+		/* nobody waits for async messages, free them here. On error
+		 * the batch may not have reached every node: a suspend
+		 * window is not acked then, the resync gives up instead.
+		 */
+		list_for_each_entry_safe(msg, tmp, &batch, list) {
+			list_del(&msg->list);
+			cmsg = (struct cluster_msg *)msg->buf;
+			if (le32_to_cpu(cmsg->type) == SUSPEND_RANGE) {
+				if (error)
+					conf->suspend_failed = 1;
+				else
+					conf->suspend_acked_hi = le64_to_cpu(cmsg->high);
+				wake_up(&conf->suspend_wait);
+			}
+			if (msg->async) {
+				kfree(msg->buf);
+				kfree(msg);
+				continue;
+			}
+			msg->sent = error ? -EIO : 1;
+			wake_up(&msg->waiter);
+		}
 	}
-	spin_unlock(&mddev->send_lock);
 }
 
+/* hold NL on every resync region so its lvb outlives our EX grants */
+static int init_resync_regions(struct mddev *mddev)
+{
+	struct dlm_lock_resource *res;
+	char name[16];
+	int i;
+
+	for (i = 0; i < MD_RESYNC_REGIONS; i++) {
+		sprintf(name, "resync%02d", i);
+		res = init_lock_resource(mddev, name);
+		if (!res)
+			return -ENOMEM;
+		mddev->dlm_md_region[i] = res;
+		res->lksb.sb_lvbptr = kzalloc(MSG_LVB_SIZE, GFP_KERNEL);
+		if (!res->lksb.sb_lvbptr)
+			return -ENOMEM;
+		res->mode = DLM_LOCK_NL;
+		res->flags = DLM_LKF_VALBLK;
+		res->parent_lkid = 0;
+		res->bast = NULL;
+		if (dlm_lock_sync(mddev->dlm_md_lockspace, res)) {
+			printk(KERN_ERR "failed to get NL lock on %s!\n",
+			       res->name);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static void deinit_resync_regions(struct mddev *mddev)
+{
+	struct dlm_lock_resource *res;
+	int i;
+
+	for (i = 0; i < MD_RESYNC_REGIONS; i++) {
+		res = mddev->dlm_md_region[i];
+		if (!res)
+			continue;
+		if (res->lksb.sb_lkid)
+			dlm_unlock_sync(mddev->dlm_md_lockspace, res);
+		deinit_lock_resource(res);
+		mddev->dlm_md_region[i] = NULL;
+	}
+}
 
 static int stop(struct mddev *mddev);
 static int run(struct mddev *mddev)
@@ -3254,7 +3508,7 @@ static int run(struct mddev *mddev)
 	}
 	lockspace_nm[32] = '\0';
         printk(KERN_ERR "New lockspace: uuid = %s\n",lockspace_nm);
-	ret = dlm_new_lockspace(lockspace_nm, NULL, DLM_LSFL_FS, 32, 
+	ret = dlm_new_lockspace(lockspace_nm, NULL, DLM_LSFL_FS, MSG_LVB_SIZE, 
 			NULL, NULL, NULL, &mddev->dlm_md_lockspace);
 	if (ret) {
         	printk(KERN_ERR "New lockspace failed\n");
@@ -3275,10 +3529,12 @@ static int run(struct mddev *mddev)
 	mddev->dlm_md_resync = init_lock_resource(mddev, "resync");
 	if (!mddev->dlm_md_resync) 
 		goto recv_failed;
+	if (init_resync_regions(mddev))
+		goto message_failed;
 	mddev->dlm_md_message = init_lock_resource(mddev, "message");
 	if (!mddev->dlm_md_message)
 		goto message_failed;
-	mddev->dlm_md_message->lksb.sb_lvbptr = kzalloc(32, GFP_KERNEL);
+	mddev->dlm_md_message->lksb.sb_lvbptr = kzalloc(MSG_LVB_SIZE, GFP_KERNEL);
 	if (!mddev->dlm_md_message->lksb.sb_lvbptr)
 		goto message_failed;
 	mddev->dlm_md_token = init_lock_resource(mddev, "token");
@@ -3290,6 +3546,9 @@ static int run(struct mddev *mddev)
 	mddev->dlm_md_meta = init_lock_resource(mddev,"cmd-super");
 	if (!mddev->dlm_md_meta)
 		goto meta_failed;
+	mddev->dlm_md_meta->lksb.sb_lvbptr = kzalloc(MSG_LVB_SIZE, GFP_KERNEL);
+	if (!mddev->dlm_md_meta->lksb.sb_lvbptr)
+		goto meta_failed;
 	mddev->no_new_devs = init_lock_resource(mddev, "no-new-devs");
 	if (!mddev->no_new_devs)
 		goto no_new_devs_failed;
@@ -3337,6 +3596,7 @@ token_failed:
 	deinit_lock_resource(mddev->dlm_md_message);
 	mddev->dlm_md_message = NULL;
 message_failed:
+	deinit_resync_regions(mddev);
 	deinit_lock_resource(mddev->dlm_md_resync);
 	mddev->dlm_md_resync = NULL;
 recv_failed:
@@ -3347,6 +3607,7 @@ static int stop(struct mddev *mddev)
 {
 	struct r1conf *conf = mddev->private;
 	struct bitmap *bitmap = mddev->bitmap;
+	struct bio *bio;
 
 	/* wait for behind writes to complete */
 	if (bitmap && atomic_read(&bitmap->behind_writes) > 0) {
@@ -3362,8 +3623,30 @@ static int stop(struct mddev *mddev)
 
 	dlm_unlock_sync(mddev->dlm_md_lockspace, mddev->dlm_md_ack);
 	md_unregister_thread(&mddev->thread);
+	md_cancel_resize(mddev);
 	md_unregister_thread(&mddev->recv_thread);
+	/* after raid1d, which queues the metadata refresh */
+	md_drop_super(mddev);
 	md_unregister_thread(&mddev->send_thread);
+	/* with raid1d and the receive thread gone nothing releases parked
+	 * writes any more: fail what is left before the locks go away */
+	cancel_work_sync(&conf->deferred_work);
+	while ((bio = bio_list_pop(&conf->deferred_writes))) {
+		bio_io_error(bio);
+		put_parked_write(mddev);
+	}
+	while (!list_empty(&mddev->suspend_range)) {
+		struct suspend_range_list *suspend;
+		suspend = list_entry(mddev->suspend_range.next,
+				     struct suspend_range_list, list);
+		list_del(&suspend->list);
+		while ((bio = bio_list_pop(&suspend->deferred))) {
+			bio_io_error(bio);
+			put_parked_write(mddev);
+		}
+		kfree(suspend);
+	}
+	deinit_resync_regions(mddev);
 	deinit_lock_resource(mddev->dlm_md_resync);
 	deinit_lock_resource(mddev->dlm_md_message);
 	deinit_lock_resource(mddev->dlm_md_token);
@@ -3378,13 +3661,8 @@ static int stop(struct mddev *mddev)
 	mddev->no_new_devs = NULL;
 	mddev->res_uuid = NULL;
 	dlm_release_lockspace(mddev->dlm_md_lockspace, 0);
-	while (!list_empty(&mddev->dlm_md_bitmap)) {
-		struct dlm_lock_resource *pos;
-		pos = list_entry(mddev->dlm_md_bitmap.next, struct dlm_lock_resource,
-				list);
-		list_del(&pos->list);
-		deinit_lock_resource(pos);
-	}
+	kfree(rcu_dereference_protected(mddev->suspend_index, 1));
+	RCU_INIT_POINTER(mddev->suspend_index, NULL);
 	if (conf->r1bio_pool)
 		mempool_destroy(conf->r1bio_pool);
 	kfree(conf->mirrors);
@@ -3590,12 +3868,22 @@ static struct md_personality raid1_personality =
 
 static int __init raid_init(void)
 {
-	return register_md_personality(&raid1_personality);
+	int ret;
+
+	raid1_deferred_wq = alloc_workqueue("raid1_deferred",
+					    WQ_MEM_RECLAIM, 0);
+	if (!raid1_deferred_wq)
+		return -ENOMEM;
+	ret = register_md_personality(&raid1_personality);
+	if (ret)
+		destroy_workqueue(raid1_deferred_wq);
+	return ret;
 }
 
 static void raid_exit(void)
 {
 	unregister_md_personality(&raid1_personality);
+	destroy_workqueue(raid1_deferred_wq);
 }
 
 module_init(raid_init);
@@ -76,6 +76,27 @@ struct r1conf {
 	 */
 	int			recovery_disabled;
 
+	/* In a cluster, resync announces a suspend window to the other
+	 * nodes ahead of the resync position instead of one message per
+	 * resync request. suspend_sent_hi is the end of the window sent
+	 * out, suspend_acked_hi the end of the window every node has
+	 * acked. suspend_bitmap is the slot the window was announced
+	 * under, -1 when nothing is announced. suspend_failed is set when
+	 * a window could not be delivered and the resync must stop.
+	 */
+	sector_t		suspend_sent_hi;
+	sector_t		suspend_acked_hi;
+	sector_t		suspend_base;	/* mddev->region_start it was sent for */
+	int			suspend_failed;
+	int			suspend_bitmap;
+	wait_queue_head_t	suspend_wait;
+
+	/* writes that were parked on another node's suspend window and
+	 * are now free to go. deferred_work resubmits them.
+	 */
+	spinlock_t		deferred_lock;
+	struct bio_list		deferred_writes;
+	struct work_struct	deferred_work;
 
 	/* poolinfo contains information about the content of the
 	 * mempools - it changes when the array grows or shrinks